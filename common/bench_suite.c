@@ -0,0 +1,686 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+
+#define MAX_COMMAND 256
+#define MAX_ARGS 32
+#define MAX_BENCHMARKS 256
+#define CELL_LINE_LENGTH 24
+#define NUM_COUNTERS 4
+
+#define USAGE "Usage: ./bench_suite [-r<repeats>] [-w<warmup runs>] [-t<max threads>] [-n<max ranks>] [-c<max cells exponent>] [-d<data directory>] [-o<output>] [-b<baseline>] [-p<tolerance percent>] <repository> [newton] [cells] [opencl] [mpi]\n"
+
+// The command is what is written to the csv file and compared with the baseline.
+// It runs in the data directory, with leading VAR=value words set in its
+// environment, and ./name standing for the program at path in the repository.
+struct benchmark {
+    char command[MAX_COMMAND];
+    const char* path;
+};
+
+// The columns of the hyperfine csv files, in seconds, followed by the hardware
+// counters averaged over the runs, if they could be read.
+struct result {
+    char command[MAX_COMMAND];
+    double mean;
+    double stddev;
+    double median;
+    double user;
+    double system;
+    double min;
+    double max;
+    int has_counters;
+    double counters[NUM_COUNTERS];
+};
+
+struct sample {
+    double wall;
+    double user;
+    double system;
+    int has_counters;
+    double counters[NUM_COUNTERS];
+};
+
+// Sparse grids have entries random non-zero cells, and dense grids, with no
+// entries, have every cell non-zero.
+struct grid {
+    const char* name;
+    long cols;
+    long rows;
+    long entries;
+    const char* diffusion_constant;
+    long iterations;
+};
+
+struct options {
+    int repeats;
+    int warmup;
+    int max_threads;
+    int max_ranks;
+    int max_cells_exponent;
+    const char* data_dir;
+    const char* output;
+    const char* baseline;
+    double tolerance;
+    const char* root;
+};
+
+static const char* counter_names[NUM_COUNTERS] = {"cycles", "instructions", "cache_misses", "branch_misses"};
+static const unsigned long long counter_configs[NUM_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
+
+static const struct grid grids[] = {
+    {"sparse_100_100", 100, 100, 100, "0.01", 10000},
+    {"sparse_100000_100", 100000, 100, 1000, "0.6", 200},
+    {"sparse_10000_10000", 10000, 10000, 10000, "0.02", 100},
+    {"dense_1000_1000", 1000, 1000, 0, "0.1", 1000},
+};
+#define NUM_GRIDS (sizeof(grids) / sizeof(grids[0]))
+// The cell files of 10^CELLS_THREAD_EXPONENT lines are the ones the threads are swept on.
+#define CELLS_THREAD_EXPONENT 4
+
+void parse_args(int argc, char* argv[], struct options* opts, int* first_suite);
+int wants_suite(int argc, char* argv[], int first_suite, const char* suite);
+int add_benchmark(struct benchmark* benchmarks, int n, const char* path, const char* format, ...);
+int add_newton(struct benchmark* benchmarks, int n, const struct options* opts);
+int add_cells(struct benchmark* benchmarks, int n, const struct options* opts);
+int add_opencl(struct benchmark* benchmarks, int n, const struct options* opts);
+int add_mpi(struct benchmark* benchmarks, int n, const struct options* opts);
+int next_count(int count, int max);
+void link_into_data_dir(const struct options* opts, const char* path);
+void generate_cells(const char* filename, long lines);
+void generate_grid(const char* filename, const struct grid* g);
+int run_benchmark(const struct benchmark* b, const struct options* opts, struct result* r);
+int run_once(const struct benchmark* b, const struct options* opts, struct sample* s);
+int open_counters(pid_t pid, int fds[NUM_COUNTERS]);
+int read_counters(int fds[NUM_COUNTERS], double counts[NUM_COUNTERS]);
+void summarize(const char* command, struct sample* samples, int n, struct result* r);
+int compare_doubles(const void* a, const void* b);
+void write_results(const char* filename, struct result* results, int n);
+int read_results(const char* filename, struct result* results, int max);
+int check_regressions(struct result* results, int n, struct result* baseline, int num_baseline, double tolerance);
+double now();
+
+// Benchmarks the programs of the labs on synthetic inputs, which are generated in
+// the data directory the first time they are needed. Each program is swept over
+// input sizes and thread counts, and heat_diffusion in lab_5 over ranks as well.
+// The results go to a csv file with the columns of the hyperfine ones and the
+// hardware counters, and the exit status is 2 if any median got slower than in the
+// baseline by more than the tolerance and the noise.
+int main(int argc, char* argv[]) {
+    struct options opts;
+    int first_suite;
+    parse_args(argc, argv, &opts, &first_suite);
+
+    if (mkdir(opts.data_dir, 0755) != 0 && errno != EEXIST) {
+        printf("could not create directory %s\n", opts.data_dir);
+        return 1;
+    }
+
+    static struct benchmark benchmarks[MAX_BENCHMARKS];
+    int n = 0;
+    if (wants_suite(argc, argv, first_suite, "newton")) {
+        n = add_newton(benchmarks, n, &opts);
+    }
+    if (wants_suite(argc, argv, first_suite, "cells")) {
+        n = add_cells(benchmarks, n, &opts);
+    }
+    if (wants_suite(argc, argv, first_suite, "opencl")) {
+        n = add_opencl(benchmarks, n, &opts);
+    }
+    if (wants_suite(argc, argv, first_suite, "mpi")) {
+        n = add_mpi(benchmarks, n, &opts);
+    }
+
+    static struct result results[MAX_BENCHMARKS];
+    int num_results = 0;
+    for (int i = 0; i < n; i++) {
+        if (run_benchmark(benchmarks + i, &opts, results + num_results) == 0) {
+            num_results++;
+        }
+    }
+    write_results(opts.output, results, num_results);
+
+    if (opts.baseline == NULL) {
+        return 0;
+    }
+    static struct result baseline[MAX_BENCHMARKS];
+    int num_baseline = read_results(opts.baseline, baseline, MAX_BENCHMARKS);
+    if (num_baseline < 0) {
+        return 1;
+    }
+    return check_regressions(results, num_results, baseline, num_baseline, opts.tolerance) > 0 ? 2 : 0;
+}
+
+void parse_args(int argc, char* argv[], struct options* opts, int* first_suite) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    opts->repeats = 5;
+    opts->warmup = 1;
+    opts->max_threads = cpus > 0 ? cpus : 1;
+    opts->max_ranks = opts->max_threads;
+    opts->max_cells_exponent = 4;
+    opts->data_dir = "bench_data";
+    opts->output = "bench.csv";
+    opts->baseline = NULL;
+    opts->tolerance = 10;
+
+    int option;
+    while ((option = getopt(argc, argv, "r:w:t:n:c:d:o:b:p:")) != -1) {
+        switch (option) {
+            case 'r':
+                opts->repeats = atoi(optarg);
+                break;
+            case 'w':
+                opts->warmup = atoi(optarg);
+                break;
+            case 't':
+                opts->max_threads = atoi(optarg);
+                break;
+            case 'n':
+                opts->max_ranks = atoi(optarg);
+                break;
+            case 'c':
+                opts->max_cells_exponent = atoi(optarg);
+                break;
+            case 'd':
+                opts->data_dir = optarg;
+                break;
+            case 'o':
+                opts->output = optarg;
+                break;
+            case 'b':
+                opts->baseline = optarg;
+                break;
+            case 'p':
+                opts->tolerance = atof(optarg);
+                break;
+            default:
+                printf(USAGE);
+                exit(1);
+        }
+    }
+
+    if (optind >= argc || opts->repeats < 1 || opts->warmup < 0 || opts->max_threads < 1 || opts->max_ranks < 1
+            || opts->max_cells_exponent < 2 || opts->max_cells_exponent > 7 || opts->tolerance < 0) {
+        printf(USAGE);
+        exit(1);
+    }
+    opts->root = argv[optind];
+    *first_suite = optind + 1;
+}
+
+// Without any suites named, all of them run.
+int wants_suite(int argc, char* argv[], int first_suite, const char* suite) {
+    if (first_suite >= argc) {
+        return 1;
+    }
+    for (int i = first_suite; i < argc; i++) {
+        if (strcmp(argv[i], suite) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int add_benchmark(struct benchmark* benchmarks, int n, const char* path, const char* format, ...) {
+    if (n == MAX_BENCHMARKS) {
+        printf("too many benchmarks\n");
+        exit(1);
+    }
+    va_list args;
+    va_start(args, format);
+    vsnprintf(benchmarks[n].command, MAX_COMMAND, format, args);
+    va_end(args);
+    benchmarks[n].path = path;
+
+    // The sweeps overlap, for example on all threads or ranks, and a command that is
+    // already in the list would only give the csv a second row for it.
+    for (int i = 0; i < n; i++) {
+        if (strcmp(benchmarks[i].path, path) == 0 && strcmp(benchmarks[i].command, benchmarks[n].command) == 0) {
+            return n;
+        }
+    }
+    return n + 1;
+}
+
+// Every degree on a small picture, a few picture sizes, and the threads on a
+// picture large enough to keep them busy.
+int add_newton(struct benchmark* benchmarks, int n, const struct options* opts) {
+    const char* path = "lab_2/newton";
+    for (int degree = 1; degree <= 9; degree += 2) {
+        n = add_benchmark(benchmarks, n, path, "./newton -t%d -l1000 %d", opts->max_threads, degree);
+    }
+    long sizes[] = {500, 2000, 4000};
+    for (int i = 0; i < 3; i++) {
+        n = add_benchmark(benchmarks, n, path, "./newton -t%d -l%ld 7", opts->max_threads, sizes[i]);
+    }
+    for (int t = 1; t <= opts->max_threads; t = next_count(t, opts->max_threads)) {
+        n = add_benchmark(benchmarks, n, path, "./newton -t%d -l2000 5", t);
+    }
+    return n;
+}
+
+int add_cells(struct benchmark* benchmarks, int n, const struct options* opts) {
+    const char* path = "lab_3/cell_distances";
+    long lines = 1;
+    for (int e = 1; e <= opts->max_cells_exponent; e++) {
+        lines *= 10;
+        if (e < 2) {
+            continue;
+        }
+        char filename[PATH_MAX];
+        snprintf(filename, PATH_MAX, "%s/cells_1e%d", opts->data_dir, e);
+        generate_cells(filename, lines);
+        n = add_benchmark(benchmarks, n, path, "./cell_distances -t%d cells_1e%d", opts->max_threads, e);
+    }
+    if (opts->max_cells_exponent >= CELLS_THREAD_EXPONENT) {
+        for (int t = 1; t <= opts->max_threads; t = next_count(t, opts->max_threads)) {
+            n = add_benchmark(benchmarks, n, path, "./cell_distances -t%d cells_1e%d", t, CELLS_THREAD_EXPONENT);
+        }
+    }
+    return n;
+}
+
+int add_opencl(struct benchmark* benchmarks, int n, const struct options* opts) {
+    link_into_data_dir(opts, "lab_4/heat_diffusion.cl");
+    for (size_t i = 0; i < NUM_GRIDS; i++) {
+        const struct grid* g = grids + i;
+        char filename[PATH_MAX];
+        snprintf(filename, PATH_MAX, "%s/%s", opts->data_dir, g->name);
+        generate_grid(filename, g);
+        n = add_benchmark(benchmarks, n, "lab_4/heat_diffusion", "./heat_diffusion -d%s -n%ld %s", g->diffusion_constant, g->iterations, g->name);
+    }
+    return n;
+}
+
+// Every grid on all ranks, and the ranks and threads per rank swept on the dense
+// grid, which has the most work per iteration.
+int add_mpi(struct benchmark* benchmarks, int n, const struct options* opts) {
+    const char* path = "lab_5/heat_diffusion";
+    for (size_t i = 0; i < NUM_GRIDS; i++) {
+        const struct grid* g = grids + i;
+        char filename[PATH_MAX];
+        snprintf(filename, PATH_MAX, "%s/%s", opts->data_dir, g->name);
+        generate_grid(filename, g);
+        n = add_benchmark(benchmarks, n, path, "OMP_NUM_THREADS=1 mpirun -n %d ./heat_diffusion -d%s -n%ld %s",
+            opts->max_ranks, g->diffusion_constant, g->iterations, g->name);
+    }
+
+    const struct grid* dense = grids + NUM_GRIDS - 1;
+    for (int ranks = 1; ranks <= opts->max_ranks; ranks = next_count(ranks, opts->max_ranks)) {
+        for (int t = 1; ranks * t <= opts->max_threads; t = next_count(t, opts->max_threads)) {
+            n = add_benchmark(benchmarks, n, path, "OMP_NUM_THREADS=%d mpirun -n %d ./heat_diffusion -d%s -n%ld %s",
+                t, ranks, dense->diffusion_constant, dense->iterations, dense->name);
+        }
+    }
+    return n;
+}
+
+// Powers of two up to max, and max itself.
+int next_count(int count, int max) {
+    if (count == max) {
+        return max + 1;
+    }
+    return 2 * count < max ? 2 * count : max;
+}
+
+// For files the programs read from their working directory.
+void link_into_data_dir(const struct options* opts, const char* path) {
+    char relative[PATH_MAX], target[PATH_MAX], link[PATH_MAX];
+    snprintf(relative, PATH_MAX, "%s/%s", opts->root, path);
+    snprintf(link, PATH_MAX, "%s/%s", opts->data_dir, strrchr(path, '/') + 1);
+    if (realpath(relative, target) == NULL) {
+        return;
+    }
+    unlink(link);
+    if (symlink(target, link) != 0) {
+        printf("could not link %s to %s\n", link, target);
+    }
+}
+
+// Lines of three coordinates between -10 and 10, in the format of the cell files.
+void generate_cells(const char* filename, long lines) {
+    if (access(filename, R_OK) == 0) {
+        return;
+    }
+    printf("generating %s\n", filename);
+    FILE* fp = fopen(filename, "w");
+    if (fp == NULL) {
+        printf("could not open file %s\n", filename);
+        exit(1);
+    }
+
+    unsigned int seed = lines;
+    char line[CELL_LINE_LENGTH + 1];
+    for (long i = 0; i < lines; i++) {
+        int pos[3];
+        for (int j = 0; j < 3; j++) {
+            pos[j] = rand_r(&seed) % 20001 - 10000;
+        }
+        snprintf(line, sizeof(line), "%+07.3f %+07.3f %+07.3f\n", pos[0] / 1000.0, pos[1] / 1000.0, pos[2] / 1000.0);
+        fwrite(line, sizeof(char), CELL_LINE_LENGTH, fp);
+    }
+    fclose(fp);
+}
+
+// The text format of the heat diffusion inputs: the width and height, and then the
+// column, row and value of each non-zero cell.
+void generate_grid(const char* filename, const struct grid* g) {
+    if (access(filename, R_OK) == 0) {
+        return;
+    }
+    printf("generating %s\n", filename);
+    FILE* fp = fopen(filename, "w");
+    if (fp == NULL) {
+        printf("could not open file %s\n", filename);
+        exit(1);
+    }
+
+    unsigned int seed = g->cols * g->rows;
+    fprintf(fp, "%ld %ld\n", g->cols, g->rows);
+    if (g->entries == 0) {
+        for (long r = 0; r < g->rows; r++) {
+            for (long c = 0; c < g->cols; c++) {
+                fprintf(fp, "%ld %ld %f\n", c, r, 1e6 * rand_r(&seed) / RAND_MAX);
+            }
+        }
+    } else {
+        for (long i = 0; i < g->entries; i++) {
+            long c = rand_r(&seed) % g->cols;
+            long r = rand_r(&seed) % g->rows;
+            fprintf(fp, "%ld %ld %f\n", c, r, 1e6 * rand_r(&seed) / RAND_MAX);
+        }
+    }
+    fclose(fp);
+}
+
+// Returns -1 if the program is not built or a run fails, in which case the
+// benchmark is left out of the results.
+int run_benchmark(const struct benchmark* b, const struct options* opts, struct result* r) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s", opts->root, b->path);
+    if (access(path, X_OK) != 0) {
+        printf("skipping %s: %s is not built\n", b->command, path);
+        return -1;
+    }
+
+    struct sample samples[opts->repeats];
+    for (int i = -opts->warmup; i < opts->repeats; i++) {
+        struct sample s;
+        if (run_once(b, opts, &s) != 0) {
+            printf("skipping %s: the command failed\n", b->command);
+            return -1;
+        }
+        if (i >= 0) {
+            samples[i] = s;
+        }
+    }
+
+    summarize(b->command, samples, opts->repeats, r);
+    printf("%s: median %.4f s, min %.4f s, stddev %.4f s\n", r->command, r->median, r->min, r->stddev);
+    fflush(stdout);
+    return 0;
+}
+
+// The command starts once the counters are attached to it, which they are before
+// it execs, and they count it along with every thread and process it starts.
+int run_once(const struct benchmark* b, const struct options* opts, struct sample* s) {
+    char words[MAX_COMMAND];
+    strcpy(words, b->command);
+    char* env[MAX_ARGS];
+    char* args[MAX_ARGS + 1];
+    int num_env = 0, num_args = 0;
+    char program[PATH_MAX];
+    char* name = strrchr(b->path, '/') + 1;
+    for (char* word = strtok(words, " "); word != NULL && num_args < MAX_ARGS; word = strtok(NULL, " ")) {
+        if (num_args == 0 && strchr(word, '=') != NULL && num_env < MAX_ARGS) {
+            env[num_env++] = word;
+        } else if (word[0] == '.' && word[1] == '/' && strcmp(word + 2, name) == 0) {
+            char relative[PATH_MAX];
+            snprintf(relative, PATH_MAX, "%s/%s", opts->root, b->path);
+            if (realpath(relative, program) == NULL) {
+                return -1;
+            }
+            args[num_args++] = program;
+        } else {
+            args[num_args++] = word;
+        }
+    }
+    args[num_args] = NULL;
+
+    int go[2];
+    if (pipe(go) != 0) {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        return -1;
+    }
+    if (pid == 0) {
+        char c;
+        close(go[1]);
+        if (read(go[0], &c, 1) != 1 || chdir(opts->data_dir) != 0) {
+            _exit(127);
+        }
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        for (int i = 0; i < num_env; i++) {
+            putenv(env[i]);
+        }
+        execvp(args[0], args);
+        _exit(127);
+    }
+
+    close(go[0]);
+    int fds[NUM_COUNTERS];
+    int counting = open_counters(pid, fds);
+    double start = now();
+    int status = -1;
+    struct rusage usage;
+    if (write(go[1], "", 1) == 1) {
+        while (wait4(pid, &status, 0, &usage) == -1 && errno == EINTR) {
+        }
+    } else {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    s->wall = now() - start;
+    close(go[1]);
+
+    s->has_counters = counting && read_counters(fds, s->counters) == 0;
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    s->user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    s->system = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    return 0;
+}
+
+// Returns whether all counters could be opened, which they cannot where the kernel
+// does not allow it, as in many containers and virtual machines.
+int open_counters(pid_t pid, int fds[NUM_COUNTERS]) {
+    int all = 1;
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = counter_configs[i];
+        attr.disabled = 1;
+        attr.enable_on_exec = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[i] = syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+        all = all && fds[i] != -1;
+    }
+    return all;
+}
+
+// Counts are scaled up for the time the counter was not running, if the hardware
+// had to share it with other events.
+int read_counters(int fds[NUM_COUNTERS], double counts[NUM_COUNTERS]) {
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        unsigned long long values[3];
+        if (read(fds[i], values, sizeof(values)) != sizeof(values)) {
+            return -1;
+        }
+        counts[i] = values[2] > 0 ? (double) values[0] * values[1] / values[2] : 0;
+    }
+    return 0;
+}
+
+void summarize(const char* command, struct sample* samples, int n, struct result* r) {
+    double walls[n];
+    double sum = 0, user = 0, system = 0;
+    int has_counters = 1;
+    double counters[NUM_COUNTERS] = {0};
+    for (int i = 0; i < n; i++) {
+        walls[i] = samples[i].wall;
+        sum += samples[i].wall;
+        user += samples[i].user;
+        system += samples[i].system;
+        has_counters = has_counters && samples[i].has_counters;
+        for (int j = 0; j < NUM_COUNTERS; j++) {
+            counters[j] += samples[i].counters[j];
+        }
+    }
+    qsort(walls, n, sizeof(double), compare_doubles);
+
+    double mean = sum / n;
+    double squares = 0;
+    for (int i = 0; i < n; i++) {
+        squares += (walls[i] - mean) * (walls[i] - mean);
+    }
+
+    snprintf(r->command, MAX_COMMAND, "%s", command);
+    r->mean = mean;
+    r->stddev = n > 1 ? sqrt(squares / (n - 1)) : 0;
+    r->median = n % 2 == 1 ? walls[n / 2] : (walls[n / 2 - 1] + walls[n / 2]) / 2;
+    r->user = user / n;
+    r->system = system / n;
+    r->min = walls[0];
+    r->max = walls[n - 1];
+    r->has_counters = has_counters;
+    for (int j = 0; j < NUM_COUNTERS; j++) {
+        r->counters[j] = counters[j] / n;
+    }
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+void write_results(const char* filename, struct result* results, int n) {
+    FILE* fp = fopen(filename, "w");
+    if (fp == NULL) {
+        printf("could not open file %s\n", filename);
+        exit(1);
+    }
+    fprintf(fp, "command,mean,stddev,median,user,system,min,max");
+    for (int j = 0; j < NUM_COUNTERS; j++) {
+        fprintf(fp, ",%s", counter_names[j]);
+    }
+    fprintf(fp, "\n");
+
+    for (int i = 0; i < n; i++) {
+        struct result* r = results + i;
+        fprintf(fp, "%s,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g", r->command, r->mean, r->stddev, r->median, r->user, r->system, r->min, r->max);
+        for (int j = 0; j < NUM_COUNTERS; j++) {
+            if (r->has_counters) {
+                fprintf(fp, ",%.0f", r->counters[j]);
+            } else {
+                fprintf(fp, ",");
+            }
+        }
+        fprintf(fp, "\n");
+    }
+    fclose(fp);
+}
+
+// Reads the timing columns of a csv file written by this program or by hyperfine.
+// Returns the number of results, or -1 if the file cannot be read.
+int read_results(const char* filename, struct result* results, int max) {
+    FILE* fp = fopen(filename, "r");
+    if (fp == NULL) {
+        printf("could not open file %s\n", filename);
+        return -1;
+    }
+
+    char line[1024];
+    int n = 0;
+    if (fgets(line, sizeof(line), fp) == NULL) {
+        fclose(fp);
+        return 0;
+    }
+    while (n < max && fgets(line, sizeof(line), fp) != NULL) {
+        char* comma = strchr(line, ',');
+        if (comma == NULL || comma - line >= MAX_COMMAND) {
+            continue;
+        }
+        struct result* r = results + n;
+        memcpy(r->command, line, comma - line);
+        r->command[comma - line] = '\0';
+        if (sscanf(comma + 1, "%lf,%lf,%lf,%lf,%lf,%lf,%lf", &r->mean, &r->stddev, &r->median, &r->user, &r->system, &r->min, &r->max) == 7) {
+            n++;
+        }
+    }
+    fclose(fp);
+    return n;
+}
+
+// A command regressed if its median got slower by more than tolerance percent and
+// by more than twice the standard deviation of the difference, so that neither
+// noise on fast commands nor small changes on slow ones are flagged.
+int check_regressions(struct result* results, int n, struct result* baseline, int num_baseline, double tolerance) {
+    int regressions = 0;
+    for (int i = 0; i < n; i++) {
+        struct result* r = results + i;
+        for (int j = 0; j < num_baseline; j++) {
+            struct result* b = baseline + j;
+            if (strcmp(r->command, b->command) != 0) {
+                continue;
+            }
+            double noise = 2 * sqrt(r->stddev * r->stddev + b->stddev * b->stddev);
+            if (r->median > b->median * (1 + tolerance / 100) && r->median - b->median > noise) {
+                printf("REGRESSION %s: median %.4f s against %.4f s in the baseline (%+.1f%%)\n",
+                    r->command, r->median, b->median, 100 * (r->median / b->median - 1));
+                regressions++;
+            }
+            break;
+        }
+    }
+    printf("%d regressions against the baseline\n", regressions);
+    return regressions;
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
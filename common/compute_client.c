@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "compute_service.h"
+
+int send_request(int server, int argc, char* argv[]);
+
+// Runs a job on a program started with -S<socket>, with the arguments that would
+// otherwise be given to the program, and exits with the status of the job. The
+// output goes straight to the stdout and stderr of the client.
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        printf("Usage: ./compute_client <socket> [<arguments>...]\n");
+        return 1;
+    }
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        printf("socket path too long: %s\n", argv[1]);
+        return 1;
+    }
+    strcpy(addr.sun_path, argv[1]);
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server == -1 || connect(server, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        printf("could not connect to %s\n", argv[1]);
+        return 1;
+    }
+
+    if (send_request(server, argc - 2, argv + 2) != 0) {
+        printf("could not send job to %s\n", argv[1]);
+        return 1;
+    }
+
+    int32_t status;
+    char* p = (char*) &status;
+    size_t left = sizeof(status);
+    while (left > 0) {
+        ssize_t n = read(server, p, left);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // The worker died without reporting, most likely from a signal.
+            printf("lost connection to %s\n", argv[1]);
+            return 1;
+        }
+        p += n;
+        left -= n;
+    }
+    close(server);
+    return status;
+}
+
+int send_request(int server, int argc, char* argv[]) {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return -1;
+    }
+
+    size_t length = strlen(cwd) + 1;
+    for (int i = 0; i < argc; i++) {
+        length += strlen(argv[i]) + 1;
+    }
+    char* strings = (char*) malloc(length);
+    if (strings == NULL) {
+        return -1;
+    }
+    char* s = stpcpy(strings, cwd) + 1;
+    for (int i = 0; i < argc; i++) {
+        s = stpcpy(s, argv[i]) + 1;
+    }
+
+    struct compute_request_header header = {length, argc};
+    int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))] = {0};
+    struct iovec iov = {&header, sizeof(header)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int error = sendmsg(server, &msg, 0) != sizeof(header);
+    for (size_t sent = 0; !error && sent < length; ) {
+        ssize_t n = write(server, strings + sent, length - sent);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        error = n <= 0;
+        sent += n > 0 ? n : 0;
+    }
+    free(strings);
+    return error ? -1 : 0;
+}
@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "compute_service.h"
+
+#define LISTEN_BACKLOG 64
+#define MAX_REQUEST_LENGTH (1 << 20)
+// A worker that dies within a second of starting is restarted a second later, so
+// that one that cannot even warm up does not spin.
+#define RESTART_DELAY 1
+
+static void serve_worker(int listener, char* program, compute_job_main job_main, void (*warm_up)(void));
+static void report_exit(int status, void* arg);
+static int receive_request(int client, int fds[2], char** strings, uint32_t* length);
+static int read_full(int fd, void* buffer, size_t len);
+static int write_full(int fd, const void* buffer, size_t len);
+
+// The job the worker is running, which is finished from report_exit if it exits.
+static struct compute_job* current_job = NULL;
+
+const char* compute_service_path(int argc, char* argv[]) {
+    size_t len = strlen(COMPUTE_SERVICE_OPTION);
+    if (argc == 2 && strncmp(argv[1], COMPUTE_SERVICE_OPTION, len) == 0 && argv[1][len] != '\0') {
+        return argv[1] + len;
+    }
+    return NULL;
+}
+
+int compute_serve(const char* path, char* program, compute_job_main job_main, void (*warm_up)(void)) {
+    int listener = compute_listen(path);
+    if (listener == -1) {
+        return 1;
+    }
+
+    // A client that goes away in the middle of a job must not take the worker with it.
+    signal(SIGPIPE, SIG_IGN);
+    printf("serving %s on %s\n", program, path);
+    fflush(stdout);
+
+    while (1) {
+        time_t started = time(NULL);
+        pid_t worker = fork();
+        if (worker == -1) {
+            printf("could not start worker\n");
+            return 1;
+        }
+        if (worker == 0) {
+            serve_worker(listener, program, job_main, warm_up);
+        }
+
+        int status;
+        while (waitpid(worker, &status, 0) == -1 && errno == EINTR) {
+        }
+        if (time(NULL) - started < RESTART_DELAY) {
+            sleep(RESTART_DELAY);
+        }
+    }
+}
+
+int compute_listen(const char* path) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == -1) {
+        printf("could not create socket\n");
+        return -1;
+    }
+    unlink(path);
+    if (bind(listener, (struct sockaddr*) &addr, sizeof(addr)) == -1 || listen(listener, LISTEN_BACKLOG) == -1) {
+        printf("could not listen on %s\n", path);
+        close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+// Requests that are cut short or malformed are dropped. A job whose working
+// directory does not exist is answered with status 1 right away.
+int compute_accept(int listener, char* program, struct compute_job* job) {
+    while (1) {
+        int client = accept(listener, NULL, NULL);
+        if (client == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("could not accept client\n");
+            return -1;
+        }
+
+        int fds[2];
+        char* strings;
+        uint32_t length;
+        if (receive_request(client, fds, &strings, &length) != 0) {
+            close(client);
+            continue;
+        }
+
+        fflush(stdout);
+        fflush(stderr);
+        int saved_fds[2] = {dup(STDOUT_FILENO), dup(STDERR_FILENO)};
+        dup2(fds[0], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+
+        // Unpacking resets the job, so the saved descriptors are only set after it.
+        int error = compute_unpack_job(strings, length, program, job);
+        job->client = client;
+        job->saved_fds[0] = saved_fds[0];
+        job->saved_fds[1] = saved_fds[1];
+        if (error == 0) {
+            return 0;
+        }
+        compute_finish(job, 1);
+    }
+}
+
+void compute_finish(struct compute_job* job, int status) {
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < 2; i++) {
+        if (job->saved_fds[i] != -1) {
+            dup2(job->saved_fds[i], i == 0 ? STDOUT_FILENO : STDERR_FILENO);
+            close(job->saved_fds[i]);
+            job->saved_fds[i] = -1;
+        }
+    }
+
+    if (job->client != -1) {
+        int32_t reply = status;
+        write_full(job->client, &reply, sizeof(reply));
+        close(job->client);
+        job->client = -1;
+    }
+    compute_free_job(job);
+}
+
+// The working directory takes the place of the program name in the arguments.
+int compute_unpack_job(char* strings, uint32_t length, char* program, struct compute_job* job) {
+    job->client = -1;
+    job->strings = strings;
+    job->length = length;
+    job->saved_fds[0] = -1;
+    job->saved_fds[1] = -1;
+
+    int count = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        count += strings[i] == '\0';
+    }
+    job->argc = count;
+    job->argv = (char**) malloc(sizeof(char*) * (count + 1));
+    if (job->argv == NULL) {
+        printf("could not allocate memory\n");
+        exit(1);
+    }
+    job->argv[0] = program;
+    char* s = strings + strlen(strings) + 1;
+    for (int i = 1; i < count; i++) {
+        job->argv[i] = s;
+        s += strlen(s) + 1;
+    }
+    job->argv[count] = NULL;
+
+    // Makes getopt start over with the new arguments.
+    optind = 0;
+
+    if (chdir(strings) != 0) {
+        printf("could not change directory to %s\n", strings);
+        return -1;
+    }
+    return 0;
+}
+
+void compute_free_job(struct compute_job* job) {
+    free(job->argv);
+    free(job->strings);
+    job->argv = NULL;
+    job->strings = NULL;
+}
+
+static void serve_worker(int listener, char* program, compute_job_main job_main, void (*warm_up)(void)) {
+    on_exit(report_exit, NULL);
+    if (warm_up != NULL) {
+        warm_up();
+    }
+
+    while (1) {
+        struct compute_job job;
+        if (compute_accept(listener, program, &job) != 0) {
+            exit(1);
+        }
+        current_job = &job;
+        int status = job_main(job.argc, job.argv);
+        current_job = NULL;
+        compute_finish(&job, status);
+    }
+}
+
+static void report_exit(int status, void* arg) {
+    (void) arg;
+    if (current_job != NULL) {
+        struct compute_job* job = current_job;
+        current_job = NULL;
+        compute_finish(job, status);
+    }
+}
+
+static int receive_request(int client, int fds[2], char** strings, uint32_t* length) {
+    struct compute_request_header header;
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = {&header, sizeof(header)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(client, &msg, MSG_WAITALL) != sizeof(header)) {
+        return -1;
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+
+    *length = header.length;
+    *strings = header.length > 0 && header.length <= MAX_REQUEST_LENGTH ? (char*) malloc(header.length) : NULL;
+    if (*strings == NULL || read_full(client, *strings, header.length) != 0 || (*strings)[header.length - 1] != '\0') {
+        free(*strings);
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    return 0;
+}
+
+static int read_full(int fd, void* buffer, size_t len) {
+    char* p = (char*) buffer;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void* buffer, size_t len) {
+    const char* p = (const char*) buffer;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef COMPUTE_SERVICE_H
+#define COMPUTE_SERVICE_H
+
+#include <stdint.h>
+
+// A program started with -S<socket> serves jobs from compute_client over a Unix
+// domain socket instead of running one, so that threads, OpenCL programs and buffers
+// stay warm between jobs. A job is the arguments the program would take on the
+// command line, and runs in the working directory of the client, writing straight
+// to its stdout and stderr, so the output is the same as when run directly.
+#define COMPUTE_SERVICE_OPTION "-S"
+
+// A request is this header, which also passes the client's stdout and stderr, and
+// then length bytes of NUL-terminated strings: the working directory followed by
+// the arguments. The reply is the exit status as an int32_t.
+struct compute_request_header {
+    uint32_t length;
+    uint32_t count;
+};
+
+// The arguments of a job start with the name of the serving program, and point into
+// strings, which is what compute_unpack_job takes on other MPI ranks.
+struct compute_job {
+    int client;
+    char* strings;
+    uint32_t length;
+    int argc;
+    char** argv;
+    int saved_fds[2];
+};
+
+// Runs a job with the command line arguments of the program, returning its exit
+// status.
+typedef int (*compute_job_main)(int argc, char* argv[]);
+
+// Returns the socket path if the arguments ask to serve jobs, and NULL otherwise.
+const char* compute_service_path(int argc, char* argv[]);
+
+// Serves jobs one at a time until killed. The jobs run in a worker process, after
+// warm_up if it is not NULL, and a job that exits instead of returning takes the
+// worker down with it. Its status is still sent to the client, and a new worker is
+// started for the next job.
+int compute_serve(const char* path, char* program, compute_job_main job_main, void (*warm_up)(void));
+
+// The parts of compute_serve, for programs that cannot fork a worker, like MPI
+// ranks. compute_accept waits for the next request and switches stdout, stderr and
+// the working directory over to the client's, and compute_finish switches them back
+// and replies. They return -1 on errors.
+int compute_listen(const char* path);
+int compute_accept(int listener, char* program, struct compute_job* job);
+void compute_finish(struct compute_job* job, int status);
+
+// Takes over strings, of the given length, received from the rank that accepted the
+// job, and changes to its working directory.
+int compute_unpack_job(char* strings, uint32_t length, char* program, struct compute_job* job);
+void compute_free_job(struct compute_job* job);
+
+#endif
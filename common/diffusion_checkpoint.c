@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "diffusion_checkpoint.h"
+
+static int open_checkpoint(const char* filename, struct diffusion_checkpoint_header* header);
+
+void init_diffusion_checkpoint_header(struct diffusion_checkpoint_header* header, long rows, long cols, long iterations, float diffusion_constant) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, DIFFUSION_CHECKPOINT_MAGIC, DIFFUSION_CHECKPOINT_MAGIC_LEN);
+    header->rows = rows;
+    header->cols = cols;
+    header->iterations = iterations;
+    header->diffusion_constant = diffusion_constant;
+}
+
+void diffusion_checkpoint_filename(char* filename, long iteration) {
+    snprintf(filename, DIFFUSION_CHECKPOINT_FILENAME_LEN, DIFFUSION_CHECKPOINT_FILENAME_FORMAT, iteration);
+}
+
+// The checkpoint is written next to its final name and renamed into place, so that a
+// crash while writing never leaves a truncated checkpoint behind.
+void write_diffusion_checkpoint(const char* filename, const struct diffusion_checkpoint_header* header, const float* grid) {
+    char tmp_filename[PATH_MAX];
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename);
+    FILE* f = fopen(tmp_filename, "wb");
+    if (f == NULL) {
+        printf("could not open file %s\n", tmp_filename);
+        exit(1);
+    }
+
+    size_t n = header->rows * header->cols;
+    if (fwrite(header, sizeof(*header), 1, f) != 1 || fwrite(grid, sizeof(float), n, f) != n || fclose(f) != 0
+            || rename(tmp_filename, filename) != 0) {
+        printf("could not write checkpoint %s\n", filename);
+        exit(1);
+    }
+}
+
+void read_diffusion_checkpoint(const char* filename, long padding, struct diffusion_input* input, struct diffusion_checkpoint_header* header) {
+    read_diffusion_checkpoint_block(filename, padding, NULL, input, header);
+}
+
+// Rows of the block, or of the whole grid if block is NULL, are read with one pread
+// each straight into their padded position, spread over all threads, while the
+// bounding box of non-zero values is computed.
+void read_diffusion_checkpoint_block(const char* filename, long padding, const struct diffusion_block* block, struct diffusion_input* input, struct diffusion_checkpoint_header* header) {
+    int fd = open_checkpoint(filename, header);
+
+    struct diffusion_block whole = {0, header->rows, 0, header->cols};
+    struct diffusion_block bounds = block != NULL ? *block : whole;
+    if (bounds.row_begin < 0 || bounds.row_end > (long) header->rows || bounds.row_begin >= bounds.row_end
+            || bounds.col_begin < 0 || bounds.col_end > (long) header->cols || bounds.col_begin >= bounds.col_end) {
+        printf("error read checkpoint\n");
+        exit(1);
+    }
+
+    long rows = bounds.row_end - bounds.row_begin, cols = bounds.col_end - bounds.col_begin, padded_cols = cols + 2 * padding;
+    input->rows = rows;
+    input->cols = cols;
+    input->padding = padding;
+    input->matrix = (float*) calloc((rows + 2 * padding) * padded_cols, sizeof(float));
+    if (input->matrix == NULL) {
+        printf("could not allocate memory\n");
+        exit(1);
+    }
+
+    long row_begin = LONG_MAX, row_end = LONG_MIN, col_begin = LONG_MAX, col_end = LONG_MIN;
+    long invalid = 0;
+
+    #pragma omp parallel for reduction(min:row_begin,col_begin) reduction(max:row_end,col_end) reduction(+:invalid)
+    for (long row = 0; row < rows; row++) {
+        float* dst = input->matrix + (row + padding) * padded_cols + padding;
+        size_t len = sizeof(float) * cols;
+        off_t offset = sizeof(*header) + sizeof(float) * ((row + bounds.row_begin) * header->cols + bounds.col_begin);
+        if (pread(fd, dst, len, offset) != (ssize_t) len) {
+            invalid++;
+            continue;
+        }
+        for (long col = 0; col < cols; col++) {
+            if (dst[col] != 0) {
+                row_begin = row < row_begin ? row : row_begin;
+                row_end = row + 1 > row_end ? row + 1 : row_end;
+                col_begin = col < col_begin ? col : col_begin;
+                col_end = col + 1 > col_end ? col + 1 : col_end;
+            }
+        }
+    }
+    close(fd);
+
+    if (invalid > 0) {
+        printf("error read checkpoint\n");
+        exit(1);
+    }
+
+    input->row_begin = row_begin;
+    input->row_end = row_end;
+    input->col_begin = col_begin;
+    input->col_end = col_end;
+    if (row_begin >= row_end) {
+        input->row_begin = input->row_end = input->col_begin = input->col_end = 0;
+    }
+}
+
+void read_diffusion_checkpoint_header(const char* filename, struct diffusion_checkpoint_header* header) {
+    close(open_checkpoint(filename, header));
+}
+
+static int open_checkpoint(const char* filename, struct diffusion_checkpoint_header* header) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        printf("could not open file %s\n", filename);
+        exit(1);
+    }
+
+    if (pread(fd, header, sizeof(*header), 0) != sizeof(*header)
+            || memcmp(header->magic, DIFFUSION_CHECKPOINT_MAGIC, DIFFUSION_CHECKPOINT_MAGIC_LEN) != 0
+            || header->rows == 0 || header->cols == 0) {
+        printf("error read checkpoint\n");
+        exit(1);
+    }
+    return fd;
+}
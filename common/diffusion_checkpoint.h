@@ -0,0 +1,34 @@
+#ifndef DIFFUSION_CHECKPOINT_H
+#define DIFFUSION_CHECKPOINT_H
+
+#include <stdint.h>
+
+#include "diffusion_input.h"
+
+// A checkpoint file is this header followed by the rows * cols grid of floats in
+// row-major order, without any padding.
+#define DIFFUSION_CHECKPOINT_MAGIC "HDCHKPT1"
+#define DIFFUSION_CHECKPOINT_MAGIC_LEN 8
+
+struct diffusion_checkpoint_header {
+    char magic[DIFFUSION_CHECKPOINT_MAGIC_LEN];
+    uint64_t cols;
+    uint64_t rows;
+    uint64_t iterations;
+    float diffusion_constant;
+    uint32_t reserved;
+};
+
+// Checkpoints are named after the iteration they hold, so that a run restarted from
+// one never overwrites it.
+#define DIFFUSION_CHECKPOINT_FILENAME_FORMAT "diffusion_%ld.checkpoint"
+#define DIFFUSION_CHECKPOINT_FILENAME_LEN 64
+
+void diffusion_checkpoint_filename(char* filename, long iteration);
+void init_diffusion_checkpoint_header(struct diffusion_checkpoint_header* header, long rows, long cols, long iterations, float diffusion_constant);
+void write_diffusion_checkpoint(const char* filename, const struct diffusion_checkpoint_header* header, const float* grid);
+void read_diffusion_checkpoint(const char* filename, long padding, struct diffusion_input* input, struct diffusion_checkpoint_header* header);
+void read_diffusion_checkpoint_block(const char* filename, long padding, const struct diffusion_block* block, struct diffusion_input* input, struct diffusion_checkpoint_header* header);
+void read_diffusion_checkpoint_header(const char* filename, struct diffusion_checkpoint_header* header);
+
+#endif
@@ -0,0 +1,20 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "diffusion_input.h"
+
+// Converts a heat diffusion input file to the binary sparse format, which
+// heat_diffusion reads without parsing any text.
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        printf("Usage: ./diffusion_convert <input file> <binary output file>\n");
+        return 1;
+    }
+
+    struct diffusion_input input;
+    read_diffusion_input(argv[1], 0, &input);
+    write_diffusion_binary(argv[2], &input);
+    free(input.matrix);
+
+    return 0;
+}
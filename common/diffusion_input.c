@@ -0,0 +1,398 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+#include "diffusion_input.h"
+
+// Number of pieces per thread the text body is split into, so that threads that
+// get lines with short values can steal work from the others.
+#define CHUNKS_PER_THREAD 4
+#define MAX_SIGNIFICANT_DIGITS 19
+
+static const char* map_file(const char* filename, size_t* size);
+static int is_binary(const char* data, size_t size);
+static const char* read_text_dimensions(const char* data, size_t size, long* rows, long* cols);
+static void read_text(const char* data, size_t size, long padding, const struct diffusion_block* block, struct diffusion_input* input);
+static void read_binary(const char* data, size_t size, long padding, const struct diffusion_block* block, struct diffusion_input* input);
+static void allocate_matrix(long rows, long cols, long padding, const struct diffusion_block* block, struct diffusion_block* bounds, struct diffusion_input* input);
+static void set_bounding_box(struct diffusion_input* input, long row_begin, long row_end, long col_begin, long col_end);
+static const char* skip_space(const char* p, const char* end);
+static const char* parse_long(const char* p, const char* end, long* value);
+static const char* parse_float(const char* p, const char* end, float* value);
+static double power_of_ten(int exponent);
+
+void read_diffusion_input(const char* filename, long padding, struct diffusion_input* input) {
+    read_diffusion_input_block(filename, padding, NULL, input);
+}
+
+// Reads only the values within block, or the whole grid if block is NULL. The whole
+// file is still parsed, so that every process of a distributed run can pick out the
+// values of its own block without any of them holding the whole grid.
+void read_diffusion_input_block(const char* filename, long padding, const struct diffusion_block* block, struct diffusion_input* input) {
+    size_t size;
+    const char* data = map_file(filename, &size);
+
+    if (is_binary(data, size)) {
+        read_binary(data, size, padding, block, input);
+    } else {
+        read_text(data, size, padding, block, input);
+    }
+
+    munmap((void*) data, size);
+}
+
+// Only the pages holding the header are read.
+void read_diffusion_dimensions(const char* filename, long* rows, long* cols) {
+    size_t size;
+    const char* data = map_file(filename, &size);
+
+    if (is_binary(data, size)) {
+        struct diffusion_binary_header header;
+        if (size < sizeof(header)) {
+            printf("error read input file\n");
+            exit(1);
+        }
+        memcpy(&header, data, sizeof(header));
+        *rows = header.rows;
+        *cols = header.cols;
+    } else {
+        read_text_dimensions(data, size, rows, cols);
+    }
+
+    munmap((void*) data, size);
+}
+
+void write_diffusion_binary(const char* filename, const struct diffusion_input* input) {
+    FILE* f = fopen(filename, "wb");
+    if (f == NULL) {
+        printf("could not open file %s\n", filename);
+        exit(1);
+    }
+
+    long padded_cols = input->cols + 2 * input->padding;
+    uint64_t num_entries = 0;
+    for (long row = input->row_begin; row < input->row_end; row++) {
+        for (long col = input->col_begin; col < input->col_end; col++) {
+            num_entries += input->matrix[(row + input->padding) * padded_cols + col + input->padding] != 0;
+        }
+    }
+
+    struct diffusion_binary_header header;
+    memcpy(header.magic, DIFFUSION_BINARY_MAGIC, DIFFUSION_BINARY_MAGIC_LEN);
+    header.cols = input->cols;
+    header.rows = input->rows;
+    header.num_entries = num_entries;
+    fwrite(&header, sizeof(header), 1, f);
+
+    for (long row = input->row_begin; row < input->row_end; row++) {
+        for (long col = input->col_begin; col < input->col_end; col++) {
+            float value = input->matrix[(row + input->padding) * padded_cols + col + input->padding];
+            if (value != 0) {
+                struct diffusion_binary_entry entry = {col, row, value};
+                fwrite(&entry, sizeof(entry), 1, f);
+            }
+        }
+    }
+
+    if (fclose(f) != 0) {
+        printf("could not write file %s\n", filename);
+        exit(1);
+    }
+}
+
+static const char* map_file(const char* filename, size_t* size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        printf("could not open file %s\n", filename);
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        printf("error read input file\n");
+        exit(1);
+    }
+    *size = st.st_size;
+
+    void* data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        printf("could not map file %s\n", filename);
+        exit(1);
+    }
+    madvise(data, *size, MADV_WILLNEED);
+    return data;
+}
+
+static int is_binary(const char* data, size_t size) {
+    return size >= DIFFUSION_BINARY_MAGIC_LEN && memcmp(data, DIFFUSION_BINARY_MAGIC, DIFFUSION_BINARY_MAGIC_LEN) == 0;
+}
+
+// Returns a pointer to the body following the dimensions.
+static const char* read_text_dimensions(const char* data, size_t size, long* rows, long* cols) {
+    const char* end = data + size;
+    const char* body = parse_long(skip_space(data, end), end, cols);
+    if (body != NULL) {
+        body = parse_long(skip_space(body, end), end, rows);
+    }
+    if (body == NULL) {
+        printf("error read input file\n");
+        exit(1);
+    }
+    return body;
+}
+
+static void read_text(const char* data, size_t size, long padding, const struct diffusion_block* block, struct diffusion_input* input) {
+    const char* end = data + size;
+    long rows, cols;
+    const char* body = read_text_dimensions(data, size, &rows, &cols);
+    struct diffusion_block bounds;
+    allocate_matrix(rows, cols, padding, block, &bounds, input);
+
+    // Split the body into chunks that start at the beginning of a line.
+    int num_chunks = omp_get_max_threads() * CHUNKS_PER_THREAD;
+    const char* chunk_begins[num_chunks + 1];
+    size_t body_len = end - body;
+    for (int i = 0; i < num_chunks; i++) {
+        const char* p = body + body_len * i / num_chunks;
+        while (i > 0 && p < end && p[-1] != '\n') {
+            p++;
+        }
+        chunk_begins[i] = p;
+    }
+    chunk_begins[num_chunks] = end;
+
+    long padded_cols = input->cols + 2 * padding;
+    long row_begin = LONG_MAX, row_end = LONG_MIN, col_begin = LONG_MAX, col_end = LONG_MIN;
+    long invalid = 0;
+
+    #pragma omp parallel for schedule(dynamic) reduction(min:row_begin,col_begin) reduction(max:row_end,col_end) reduction(+:invalid)
+    for (int i = 0; i < num_chunks; i++) {
+        const char* p = chunk_begins[i];
+        const char* chunk_end = chunk_begins[i + 1];
+        while ((p = skip_space(p, chunk_end)) < chunk_end) {
+            long col, row;
+            float value;
+            p = parse_long(p, chunk_end, &col);
+            if (p != NULL) {
+                p = parse_long(skip_space(p, chunk_end), chunk_end, &row);
+            }
+            if (p != NULL) {
+                p = parse_float(skip_space(p, chunk_end), chunk_end, &value);
+            }
+            if (p == NULL || row >= rows || col >= cols) {
+                invalid++;
+                break;
+            }
+            if (row < bounds.row_begin || row >= bounds.row_end || col < bounds.col_begin || col >= bounds.col_end) {
+                continue;
+            }
+            row -= bounds.row_begin;
+            col -= bounds.col_begin;
+
+            input->matrix[(row + padding) * padded_cols + col + padding] = value;
+            if (value != 0) {
+                row_begin = row < row_begin ? row : row_begin;
+                row_end = row + 1 > row_end ? row + 1 : row_end;
+                col_begin = col < col_begin ? col : col_begin;
+                col_end = col + 1 > col_end ? col + 1 : col_end;
+            }
+        }
+    }
+
+    if (invalid > 0) {
+        printf("error read input file\n");
+        exit(1);
+    }
+    set_bounding_box(input, row_begin, row_end, col_begin, col_end);
+}
+
+static void read_binary(const char* data, size_t size, long padding, const struct diffusion_block* block, struct diffusion_input* input) {
+    struct diffusion_binary_header header;
+    if (size < sizeof(header)) {
+        printf("error read input file\n");
+        exit(1);
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.num_entries > (size - sizeof(header)) / sizeof(struct diffusion_binary_entry)) {
+        printf("error read input file\n");
+        exit(1);
+    }
+
+    long rows = header.rows, cols = header.cols;
+    struct diffusion_block bounds;
+    allocate_matrix(rows, cols, padding, block, &bounds, input);
+
+    const struct diffusion_binary_entry* entries = (const struct diffusion_binary_entry*) (data + sizeof(header));
+    long padded_cols = input->cols + 2 * padding;
+    long row_begin = LONG_MAX, row_end = LONG_MIN, col_begin = LONG_MAX, col_end = LONG_MIN;
+    long invalid = 0;
+
+    #pragma omp parallel for reduction(min:row_begin,col_begin) reduction(max:row_end,col_end) reduction(+:invalid)
+    for (uint64_t i = 0; i < header.num_entries; i++) {
+        long row = entries[i].row;
+        long col = entries[i].col;
+        float value = entries[i].value;
+        if (row >= rows || col >= cols) {
+            invalid++;
+            continue;
+        }
+        if (row < bounds.row_begin || row >= bounds.row_end || col < bounds.col_begin || col >= bounds.col_end) {
+            continue;
+        }
+        row -= bounds.row_begin;
+        col -= bounds.col_begin;
+
+        input->matrix[(row + padding) * padded_cols + col + padding] = value;
+        if (value != 0) {
+            row_begin = row < row_begin ? row : row_begin;
+            row_end = row + 1 > row_end ? row + 1 : row_end;
+            col_begin = col < col_begin ? col : col_begin;
+            col_end = col + 1 > col_end ? col + 1 : col_end;
+        }
+    }
+
+    if (invalid > 0) {
+        printf("error read input file\n");
+        exit(1);
+    }
+    set_bounding_box(input, row_begin, row_end, col_begin, col_end);
+}
+
+// Allocates the block of a rows * cols grid, or the whole grid if block is NULL, and
+// writes the part of the grid that is kept to bounds. calloc hands out fresh zero
+// pages for large sizes, so the grid is never zeroed serially; each page is touched
+// for the first time by whichever thread writes it.
+static void allocate_matrix(long rows, long cols, long padding, const struct diffusion_block* block, struct diffusion_block* bounds, struct diffusion_input* input) {
+    struct diffusion_block whole = {0, rows, 0, cols};
+    *bounds = block != NULL ? *block : whole;
+    if (rows <= 0 || cols <= 0 || bounds->row_begin < 0 || bounds->row_end > rows || bounds->row_begin >= bounds->row_end
+            || bounds->col_begin < 0 || bounds->col_end > cols || bounds->col_begin >= bounds->col_end) {
+        printf("error read input file\n");
+        exit(1);
+    }
+    input->rows = bounds->row_end - bounds->row_begin;
+    input->cols = bounds->col_end - bounds->col_begin;
+    input->padding = padding;
+    input->matrix = (float*) calloc((input->rows + 2 * padding) * (input->cols + 2 * padding), sizeof(float));
+    if (input->matrix == NULL) {
+        printf("could not allocate memory\n");
+        exit(1);
+    }
+}
+
+static void set_bounding_box(struct diffusion_input* input, long row_begin, long row_end, long col_begin, long col_end) {
+    input->row_begin = row_begin;
+    input->row_end = row_end;
+    input->col_begin = col_begin;
+    input->col_end = col_end;
+    if (row_begin >= row_end) {
+        input->row_begin = input->row_end = input->col_begin = input->col_end = 0;
+    }
+}
+
+static const char* skip_space(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+// Returns a pointer past the parsed number, or NULL if there is none.
+static const char* parse_long(const char* p, const char* end, long* value) {
+    const char* start = p;
+    long n = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        n = n * 10 + (*p - '0');
+        p++;
+    }
+    *value = n;
+    return p == start ? NULL : p;
+}
+
+// Parses [+-]digits[.digits][(e|E)[+-]digits]. The first 19 significant digits are
+// collected exactly and scaled by a power of ten in double precision, which rounds
+// to the same float as strtof except for values within 1e-9 ulp of a tie.
+static const char* parse_float(const char* p, const char* end, float* value) {
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+
+    uint64_t mantissa = 0;
+    int significant_digits = 0;
+    int exponent = 0;
+    int any_digits = 0;
+
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (significant_digits < MAX_SIGNIFICANT_DIGITS) {
+            mantissa = mantissa * 10 + (*p - '0');
+            significant_digits += mantissa != 0;
+        } else {
+            exponent++;
+        }
+        any_digits = 1;
+        p++;
+    }
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (significant_digits < MAX_SIGNIFICANT_DIGITS) {
+                mantissa = mantissa * 10 + (*p - '0');
+                significant_digits += mantissa != 0;
+                exponent--;
+            }
+            any_digits = 1;
+            p++;
+        }
+    }
+    if (!any_digits) {
+        return NULL;
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        int exponent_negative = 0;
+        if (p < end && (*p == '-' || *p == '+')) {
+            exponent_negative = *p == '-';
+            p++;
+        }
+        long explicit_exponent;
+        p = parse_long(p, end, &explicit_exponent);
+        if (p == NULL) {
+            return NULL;
+        }
+        explicit_exponent = explicit_exponent > 400 ? 400 : explicit_exponent;
+        exponent += exponent_negative ? -explicit_exponent : explicit_exponent;
+    }
+
+    double x = (double) mantissa;
+    if (exponent < 0) {
+        x /= power_of_ten(-exponent);
+    } else {
+        x *= power_of_ten(exponent);
+    }
+    *value = (float) (negative ? -x : x);
+    return p;
+}
+
+// Powers of ten up to 1e22 are exact in double precision.
+static double power_of_ten(int exponent) {
+    static const double exact[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    double x = 1;
+    while (exponent > 22) {
+        x *= 1e22;
+        exponent -= 22;
+    }
+    return x * exact[exponent];
+}
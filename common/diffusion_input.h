@@ -0,0 +1,57 @@
+#ifndef DIFFUSION_INPUT_H
+#define DIFFUSION_INPUT_H
+
+#include <stdint.h>
+
+// Binary sparse input files start with this magic, followed by a
+// struct diffusion_binary_header and num_entries struct diffusion_binary_entry.
+// Use diffusion_convert to produce them from the text format.
+#define DIFFUSION_BINARY_MAGIC "HDSPARSE"
+#define DIFFUSION_BINARY_MAGIC_LEN 8
+
+struct diffusion_binary_header {
+    char magic[DIFFUSION_BINARY_MAGIC_LEN];
+    uint64_t cols;
+    uint64_t rows;
+    uint64_t num_entries;
+};
+
+struct diffusion_binary_entry {
+    uint32_t col;
+    uint32_t row;
+    float value;
+};
+
+// Rows [row_begin, row_end) and columns [col_begin, col_end) of a grid.
+struct diffusion_block {
+    long row_begin;
+    long row_end;
+    long col_begin;
+    long col_end;
+};
+
+// When only a block of the grid is read, rows and cols are those of the block and
+// all coordinates below are relative to it.
+struct diffusion_input {
+    long rows;
+    long cols;
+
+    // Row-major grid of (rows + 2*padding) * (cols + 2*padding) values, where the
+    // padding cells and all cells not listed in the input file are zero.
+    long padding;
+    float* matrix;
+
+    // Bounding box [row_begin, row_end) x [col_begin, col_end) of all non-zero
+    // values in the input, or an empty box at 0 if there are none.
+    long row_begin;
+    long row_end;
+    long col_begin;
+    long col_end;
+};
+
+void read_diffusion_input(const char* filename, long padding, struct diffusion_input* input);
+void read_diffusion_input_block(const char* filename, long padding, const struct diffusion_block* block, struct diffusion_input* input);
+void read_diffusion_dimensions(const char* filename, long* rows, long* cols);
+void write_diffusion_binary(const char* filename, const struct diffusion_input* input);
+
+#endif
@@ -0,0 +1,314 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+#ifdef __AVX512F__
+#include <immintrin.h>
+#endif
+
+#include "diffusion_reduce.h"
+
+// A segment of 2048 cells is summed in the SIMD lanes before it is added pairwise
+// with the others, which bounds the rounding error of a sum of n cells by about
+// log2(n / 2048) additions.
+#define SEGMENT_CELLS 2048
+#define PARALLEL_MIN_CELLS 16384
+// One in 1024 cells, but at least a few thousand, are sampled for the pivot.
+#define SAMPLE_FRACTION 1024
+#define MIN_SAMPLES 4096
+#define WINDOW_ERRORS 4
+// At most one in 32 cells, but always a few thousand, are kept close to the pivot.
+#define NEAR_FRACTION 32
+#define NEAR_MIN 4096
+
+enum pass {
+    PASS_SUM,
+    PASS_PIVOT,
+    PASS_FUSED,
+};
+
+struct partial {
+    double sum;
+    double abs_diff;
+    long num_above;
+    long num_equal;
+};
+
+// The part of the list of cells close to the pivot that a range of segments fills.
+struct near_list {
+    float* values;
+    long capacity;
+    long count;
+};
+
+struct pass_args {
+    const float* m;
+    long stride;
+    const struct diffusion_block* region;
+    long segments_per_row;
+    enum pass pass;
+    double pivot;
+    double window;
+    struct near_list* near;
+};
+
+static struct partial reduce_region(const float* m, long stride, const struct diffusion_block* region, enum pass pass, double pivot, double window, struct diffusion_reduction* red);
+static struct partial reduce_segments(const struct pass_args* a, long begin, long end);
+static struct partial reduce_segment(const struct pass_args* a, long segment);
+static void pick_near(float* near, const float* x, long n, double pivot, double window);
+static void gather_near(struct diffusion_reduction* red, const struct near_list* lists, long num_ranges);
+static struct partial add_partials(struct partial l, struct partial r);
+static long get_count(const struct diffusion_block* region);
+
+double diffusion_reduce_sum(const float* m, long stride, const struct diffusion_block* region) {
+    return reduce_region(m, stride, region, PASS_SUM, 0, 0, NULL).sum;
+}
+
+double diffusion_reduce_abs_diff(const float* m, long stride, const struct diffusion_block* region, double mean) {
+    return reduce_region(m, stride, region, PASS_PIVOT, mean, -1, NULL).abs_diff;
+}
+
+void diffusion_reduce_statistics(const float* m, long stride, const struct diffusion_block* region, double* mean, double* mean_abs_diff) {
+    long count = get_count(region);
+    if (count == 0) {
+        *mean = 0;
+        *mean_abs_diff = 0;
+        return;
+    }
+
+    double moments[3] = {0};
+    double pivot, window;
+    diffusion_reduce_sample(m, stride, region, moments);
+    diffusion_reduce_pivot(moments, &pivot, &window);
+
+    struct diffusion_reduction red;
+    diffusion_reduce_fused(&red, m, stride, region, pivot, window);
+    *mean = red.sum / count;
+    *mean_abs_diff = diffusion_reduce_finish(&red, m, stride, region, *mean) / count;
+    diffusion_reduce_free(&red);
+}
+
+// The samples are spread over the cells in row-major order, so that they cover every
+// part of the region, and each costs a single cache line.
+void diffusion_reduce_sample(const float* m, long stride, const struct diffusion_block* region, double moments[3]) {
+    long count = get_count(region);
+    long cols = region->col_end - region->col_begin;
+    long num_samples = count / SAMPLE_FRACTION > MIN_SAMPLES ? count / SAMPLE_FRACTION : MIN_SAMPLES;
+    num_samples = num_samples < count ? num_samples : count;
+    for (long i = 0; i < num_samples; i++) {
+        long k = i * count / num_samples;
+        double value = m[(region->row_begin + k / cols) * stride + region->col_begin + k % cols];
+        moments[0] += 1;
+        moments[1] += value;
+        moments[2] += value * value;
+    }
+}
+
+void diffusion_reduce_pivot(const double moments[3], double* pivot, double* window) {
+    if (moments[0] == 0) {
+        *pivot = 0;
+        *window = 0;
+        return;
+    }
+    double mean = moments[1] / moments[0];
+    double variance = moments[2] / moments[0] - mean * mean;
+    *pivot = mean;
+    *window = variance > 0 ? WINDOW_ERRORS * sqrt(variance / moments[0]) : 0;
+}
+
+void diffusion_reduce_fused(struct diffusion_reduction* red, const float* m, long stride, const struct diffusion_block* region, double pivot, double window) {
+    red->pivot = pivot;
+    red->window = window;
+    red->count = get_count(region);
+    red->num_near = 0;
+    red->capacity = red->count / NEAR_FRACTION + NEAR_MIN;
+    red->near = (float*) malloc(sizeof(float) * red->capacity);
+    if (red->near == NULL) {
+        red->capacity = 0;
+    }
+
+    struct partial total = reduce_region(m, stride, region, PASS_FUSED, pivot, window, red);
+    red->sum = total.sum;
+    red->abs_diff = total.abs_diff;
+    red->num_above = total.num_above;
+    red->num_equal = total.num_equal;
+}
+
+// The cells on the far side of the pivot from the mean are offset further from the
+// mean than from the pivot, and the others offset closer, except for those between
+// the pivot and the mean, which are really on the other side of the mean. Cells equal
+// to the pivot count as below it.
+double diffusion_reduce_finish(struct diffusion_reduction* red, const float* m, long stride, const struct diffusion_block* region, double mean) {
+    double offset = mean - red->pivot;
+    if (fabs(offset) > red->window || red->num_near > red->capacity) {
+        return diffusion_reduce_abs_diff(m, stride, region, mean);
+    }
+
+    double correction = 0;
+    if (offset > 0) {
+        for (long i = 0; i < red->num_near; i++) {
+            double x = red->near[i];
+            correction += x > red->pivot && x < mean ? mean - x : 0;
+        }
+    } else {
+        for (long i = 0; i < red->num_near; i++) {
+            double x = red->near[i];
+            correction += x > mean && x < red->pivot ? x - mean : 0;
+        }
+        correction -= red->num_equal * offset;
+    }
+    long num_below = red->count - red->num_above;
+    return red->abs_diff + offset * (num_below - red->num_above) + 2 * correction;
+}
+
+void diffusion_reduce_free(struct diffusion_reduction* red) {
+    free(red->near);
+    red->near = NULL;
+}
+
+// Each thread adds up a contiguous range of segments, and the threads' sums are added
+// in order, so the result only depends on the number of threads. Each range also picks
+// the cells close to the pivot into its own part of the list, so that they end up in
+// the order of the cells however the threads run.
+static struct partial reduce_region(const float* m, long stride, const struct diffusion_block* region, enum pass pass, double pivot, double window, struct diffusion_reduction* red) {
+    struct partial total = {0};
+    long count = get_count(region);
+    if (count == 0) {
+        return total;
+    }
+
+    long cols = region->col_end - region->col_begin;
+    long segments_per_row = (cols + SEGMENT_CELLS - 1) / SEGMENT_CELLS;
+    long num_segments = (region->row_end - region->row_begin) * segments_per_row;
+
+    long num_ranges = count >= PARALLEL_MIN_CELLS ? omp_get_max_threads() : 1;
+    num_ranges = num_ranges < num_segments ? num_ranges : num_segments;
+    struct partial partials[num_ranges];
+    struct near_list lists[num_ranges];
+    #pragma omp parallel for schedule(static) if (num_ranges > 1)
+    for (long t = 0; t < num_ranges; t++) {
+        lists[t] = (struct near_list) {NULL, 0, 0};
+        if (pass == PASS_FUSED) {
+            lists[t].values = red->near + t * red->capacity / num_ranges;
+            lists[t].capacity = (t + 1) * red->capacity / num_ranges - t * red->capacity / num_ranges;
+        }
+        struct pass_args a = {m, stride, region, segments_per_row, pass, pivot, window, lists + t};
+        partials[t] = reduce_segments(&a, t * num_segments / num_ranges, (t + 1) * num_segments / num_ranges);
+    }
+
+    for (long t = 0; t < num_ranges; t++) {
+        total = add_partials(total, partials[t]);
+    }
+    if (pass == PASS_FUSED) {
+        gather_near(red, lists, num_ranges);
+    }
+    return total;
+}
+
+static struct partial reduce_segments(const struct pass_args* a, long begin, long end) {
+    if (end - begin == 1) {
+        return reduce_segment(a, begin);
+    }
+    // The halves are reduced one after the other, rather than in the unspecified order
+    // of the arguments of a call, so that the cells close to the pivot are picked in
+    // the order of the segments.
+    long mid = begin + (end - begin) / 2;
+    struct partial left = reduce_segments(a, begin, mid);
+    struct partial right = reduce_segments(a, mid, end);
+    return add_partials(left, right);
+}
+
+// The counts are kept in doubles in the loop, so that it vectorizes along with the
+// sums.
+static struct partial reduce_segment(const struct pass_args* a, long segment) {
+    const struct diffusion_block* region = a->region;
+    long r = region->row_begin + segment / a->segments_per_row;
+    long begin = region->col_begin + segment % a->segments_per_row * SEGMENT_CELLS;
+    long n = region->col_end - begin < SEGMENT_CELLS ? region->col_end - begin : SEGMENT_CELLS;
+    const float* x = a->m + r * a->stride + begin;
+    double pivot = a->pivot;
+    double window = a->window;
+
+    double sum = 0;
+    if (a->pass == PASS_SUM) {
+        #pragma omp simd reduction(+:sum)
+        for (long i = 0; i < n; i++) {
+            sum += x[i];
+        }
+        return (struct partial) {sum, 0, 0, 0};
+    }
+
+    double abs_diff = 0, num_above = 0, num_equal = 0, num_near = 0;
+    #pragma omp simd reduction(+:sum,abs_diff,num_above,num_equal,num_near)
+    for (long i = 0; i < n; i++) {
+        double d = x[i] - pivot;
+        sum += x[i];
+        abs_diff += fabs(d);
+        num_above += d > 0 ? 1 : 0;
+        num_equal += d == 0 ? 1 : 0;
+        num_near += d != 0 && fabs(d) <= window ? 1 : 0;
+    }
+
+    // The segment is still in cache, so the cells close to the pivot are picked out of
+    // it again. Once there are too many of them the rest are only counted.
+    if (a->pass == PASS_FUSED && num_near > 0) {
+        struct near_list* near = a->near;
+        if (near->count + (long) num_near <= near->capacity) {
+            pick_near(near->values + near->count, x, n, pivot, window);
+        }
+        near->count += (long) num_near;
+    }
+    return (struct partial) {sum, abs_diff, (long) num_above, (long) num_equal};
+}
+
+// Copies the cells of x within window of pivot, but not equal to it, to near, with a
+// compressing store where there is one.
+static void pick_near(float* near, const float* x, long n, double pivot, double window) {
+    long i = 0;
+#ifdef __AVX512F__
+    __m512d pivot_v = _mm512_set1_pd(pivot);
+    __m512d window_v = _mm512_set1_pd(window);
+    __m512d sign = _mm512_set1_pd(-0.0);
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_loadu_ps(x + i);
+        __m512d d = _mm512_andnot_pd(sign, _mm512_sub_pd(_mm512_cvtps_pd(v), pivot_v));
+        __mmask8 near_mask = _mm512_cmp_pd_mask(d, window_v, _CMP_LE_OQ) & _mm512_cmp_pd_mask(d, _mm512_setzero_pd(), _CMP_GT_OQ);
+        _mm256_mask_compressstoreu_ps(near, near_mask, v);
+        near += __builtin_popcount(near_mask);
+    }
+#endif
+    for (; i < n; i++) {
+        double d = fabs(x[i] - pivot);
+        if (d > 0 && d <= window) {
+            *near++ = x[i];
+        }
+    }
+}
+
+// Moves the parts of the list together in the order of the ranges. A part that
+// overflowed leaves the list incomplete, which diffusion_reduce_finish tells by
+// num_near being over the capacity.
+static void gather_near(struct diffusion_reduction* red, const struct near_list* lists, long num_ranges) {
+    red->num_near = 0;
+    int overflowed = 0;
+    for (long t = 0; t < num_ranges; t++) {
+        overflowed |= lists[t].count > lists[t].capacity;
+        if (!overflowed) {
+            memmove(red->near + red->num_near, lists[t].values, sizeof(float) * lists[t].count);
+        }
+        red->num_near += lists[t].count;
+    }
+    if (overflowed && red->num_near <= red->capacity) {
+        red->num_near = red->capacity + 1;
+    }
+}
+
+static struct partial add_partials(struct partial l, struct partial r) {
+    return (struct partial) {l.sum + r.sum, l.abs_diff + r.abs_diff, l.num_above + r.num_above, l.num_equal + r.num_equal};
+}
+
+static long get_count(const struct diffusion_block* region) {
+    long rows = region->row_end - region->row_begin;
+    long cols = region->col_end - region->col_begin;
+    return rows > 0 && cols > 0 ? rows * cols : 0;
+}
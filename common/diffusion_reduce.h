@@ -0,0 +1,56 @@
+#ifndef DIFFUSION_REDUCE_H
+#define DIFFUSION_REDUCE_H
+
+#include "diffusion_input.h"
+
+// Sums over the cells of a region, where cell (r, c) is at m[r * stride + c] as for
+// the stencil. The cells are summed in double precision in segments of a row with
+// SIMD instructions, the segments are added pairwise, and the segments are split
+// between threads.
+
+// The sum of the cells.
+double diffusion_reduce_sum(const float* m, long stride, const struct diffusion_block* region);
+
+// The sum of the absolute differences between the cells and mean.
+double diffusion_reduce_abs_diff(const float* m, long stride, const struct diffusion_block* region, double mean);
+
+// The mean and the mean absolute difference of the cells, in a single pass over
+// memory when possible.
+void diffusion_reduce_statistics(const float* m, long stride, const struct diffusion_block* region, double* mean, double* mean_abs_diff);
+
+// A single pass that sums the cells and their absolute differences to a pivot close
+// to the mean. Once the mean is known, the sum of the absolute differences to it
+// follows from those and from the cells between the pivot and the mean. The cells
+// within window of the pivot are kept for that, so the cells only have to be read
+// again if the mean is further away from the pivot, or too many of them are close.
+struct diffusion_reduction {
+    double pivot;
+    double window;
+    long count;
+    double sum;
+    double abs_diff;
+    long num_above;
+    long num_equal;
+    float* near;
+    long num_near;
+    long capacity;
+};
+
+// Adds the count, sum and sum of squares of a few evenly spaced cells of the region
+// to moments, to estimate the mean from. Summing the moments of several regions
+// estimates their combined mean.
+void diffusion_reduce_sample(const float* m, long stride, const struct diffusion_block* region, double moments[3]);
+
+// A pivot and a window from the sample moments, such that the mean is within the
+// window of the pivot unless the sample is off by more than a few standard errors.
+void diffusion_reduce_pivot(const double moments[3], double* pivot, double* window);
+
+void diffusion_reduce_fused(struct diffusion_reduction* red, const float* m, long stride, const struct diffusion_block* region, double pivot, double window);
+
+// The sum of the absolute differences between the cells and mean, which is the mean
+// of the cells or of several regions containing them.
+double diffusion_reduce_finish(struct diffusion_reduction* red, const float* m, long stride, const struct diffusion_block* region, double mean);
+
+void diffusion_reduce_free(struct diffusion_reduction* red);
+
+#endif
@@ -0,0 +1,218 @@
+#include <math.h>
+#include <string.h>
+#include <limits.h>
+#include <omp.h>
+
+#include "diffusion_stencil.h"
+
+// A strip of 1024 columns keeps the three source rows and the destination row being
+// swept within 16 kB, which stays in L1 even on wide grids, and a thread sweeps
+// bands of 32 rows of a strip at a time.
+#define STRIP_COLS 1024
+#define BAND_ROWS 32
+#define PARALLEL_MIN_CELLS 16384
+
+// The widest vectors the compiler is allowed to use, picked with -march.
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define VECTOR_WIDTH 16
+typedef __m512 vector;
+#define vector_load _mm512_loadu_ps
+#define vector_store _mm512_storeu_ps
+#define vector_set1 _mm512_set1_ps
+#define vector_add _mm512_add_ps
+#define vector_sub _mm512_sub_ps
+#define vector_mul _mm512_mul_ps
+#define vector_fma _mm512_fmadd_ps
+#define vector_max _mm512_max_ps
+#define vector_abs _mm512_abs_ps
+#define vector_reduce_max _mm512_reduce_max_ps
+#elif defined(__AVX__)
+#include <immintrin.h>
+#define VECTOR_WIDTH 8
+typedef __m256 vector;
+#define vector_load _mm256_loadu_ps
+#define vector_store _mm256_storeu_ps
+#define vector_set1 _mm256_set1_ps
+#define vector_add _mm256_add_ps
+#define vector_sub _mm256_sub_ps
+#define vector_mul _mm256_mul_ps
+#define vector_fma _mm256_fmadd_ps
+#define vector_max _mm256_max_ps
+#define vector_abs(x) _mm256_andnot_ps(_mm256_set1_ps(-0.0f), (x))
+static inline float vector_reduce_max(vector x) {
+    __m128 m = _mm_max_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+    return _mm_cvtss_f32(m);
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define VECTOR_WIDTH 4
+typedef __m128 vector;
+#define vector_load _mm_loadu_ps
+#define vector_store _mm_storeu_ps
+#define vector_set1 _mm_set1_ps
+#define vector_add _mm_add_ps
+#define vector_sub _mm_sub_ps
+#define vector_mul _mm_mul_ps
+#define vector_max _mm_max_ps
+#define vector_abs(x) _mm_andnot_ps(_mm_set1_ps(-0.0f), (x))
+static inline float vector_reduce_max(vector x) {
+    __m128 m = _mm_max_ps(x, _mm_movehl_ps(x, x));
+    m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+    return _mm_cvtss_f32(m);
+}
+#else
+#define VECTOR_WIDTH 1
+#endif
+
+static float update_row(float* restrict dst, const float* restrict src, long stride, long begin, long end, float keep, float weight, int track_change);
+static float new_temperature(float self, float sum, float keep, float weight);
+
+// c * (sum / 4 - self) + self is computed as weight * sum + keep * self, with
+// weight = c / 4 and keep = 1 - c, which saves the subtraction. The vector and
+// scalar code must round the same way, so that a cell gets the same value whichever
+// process or part of a row updates it.
+void diffusion_stencil_apply(float* dst, const float* src, long stride, const struct diffusion_block* region, float c, float* max_change) {
+    long rows = region->row_end - region->row_begin;
+    long cols = region->col_end - region->col_begin;
+    float max = 0;
+    if (rows <= 0 || cols <= 0) {
+        if (max_change != NULL) {
+            *max_change = 0;
+        }
+        return;
+    }
+
+    float keep = 1 - c;
+    float weight = c / 4;
+    int track_change = max_change != NULL;
+    long num_strips = (cols + STRIP_COLS - 1) / STRIP_COLS;
+    long num_bands = (rows + BAND_ROWS - 1) / BAND_ROWS;
+
+    // Consecutive bands of a strip go to the same thread, which sweeps them top to
+    // bottom.
+    #pragma omp parallel for collapse(2) schedule(static) if (rows * cols >= PARALLEL_MIN_CELLS) reduction(max:max)
+    for (long s = 0; s < num_strips; s++) {
+        for (long b = 0; b < num_bands; b++) {
+            long col_begin = region->col_begin + s * STRIP_COLS;
+            long col_end = col_begin + STRIP_COLS < region->col_end ? col_begin + STRIP_COLS : region->col_end;
+            long row_begin = region->row_begin + b * BAND_ROWS;
+            long row_end = row_begin + BAND_ROWS < region->row_end ? row_begin + BAND_ROWS : region->row_end;
+            for (long r = row_begin; r < row_end; r++) {
+                float change = update_row(dst + r * stride, src + r * stride, stride, col_begin, col_end, keep, weight, track_change);
+                max = change > max ? change : max;
+            }
+        }
+    }
+
+    if (max_change != NULL) {
+        *max_change = max;
+    }
+}
+
+void diffusion_stencil_first_touch(float* dst, const float* src, long stride, const struct diffusion_block* region) {
+    long rows = region->row_end - region->row_begin;
+    long cols = region->col_end - region->col_begin;
+    if (rows <= 0 || cols <= 0) {
+        return;
+    }
+    long num_strips = (cols + STRIP_COLS - 1) / STRIP_COLS;
+    long num_bands = (rows + BAND_ROWS - 1) / BAND_ROWS;
+
+    #pragma omp parallel for collapse(2) schedule(static) if (rows * cols >= PARALLEL_MIN_CELLS)
+    for (long s = 0; s < num_strips; s++) {
+        for (long b = 0; b < num_bands; b++) {
+            long col_begin = region->col_begin + s * STRIP_COLS;
+            long col_end = col_begin + STRIP_COLS < region->col_end ? col_begin + STRIP_COLS : region->col_end;
+            long row_begin = region->row_begin + b * BAND_ROWS;
+            long row_end = row_begin + BAND_ROWS < region->row_end ? row_begin + BAND_ROWS : region->row_end;
+            for (long r = row_begin; r < row_end; r++) {
+                if (src != NULL) {
+                    memcpy(dst + r * stride + col_begin, src + r * stride + col_begin, sizeof(float) * (col_end - col_begin));
+                } else {
+                    memset(dst + r * stride + col_begin, 0, sizeof(float) * (col_end - col_begin));
+                }
+            }
+        }
+    }
+}
+
+// When iteration i updates row r, iteration i - 1 has already updated rows r + 1 and
+// r + 2, and will not read row r - 1 of its source, which iteration i + 1 overwrites
+// next, again. Rows are updated one at a time, so this runs on the calling thread
+// and is meant for one thread per process.
+void diffusion_stencil_wavefront(float* buffers[2], long stride, const struct diffusion_block* regions, int steps, float c) {
+    float keep = 1 - c;
+    float weight = c / 4;
+
+    long first = LONG_MAX, last = LONG_MIN;
+    for (int i = 0; i < steps; i++) {
+        if (regions[i].row_begin < regions[i].row_end && regions[i].col_begin < regions[i].col_end) {
+            first = regions[i].row_begin < first ? regions[i].row_begin : first;
+            last = regions[i].row_end + 2 * i > last ? regions[i].row_end + 2 * i : last;
+        }
+    }
+
+    for (long p = first; p < last; p++) {
+        for (int i = 0; i < steps; i++) {
+            long r = p - 2 * i;
+            const struct diffusion_block* region = &regions[i];
+            if (r < region->row_begin || r >= region->row_end || region->col_begin >= region->col_end) {
+                continue;
+            }
+            update_row(buffers[(i + 1) % 2] + r * stride, buffers[i % 2] + r * stride, stride, region->col_begin, region->col_end, keep, weight, 0);
+        }
+    }
+}
+
+// Updates the cells [begin, end) of a row, and returns their largest absolute change
+// if track_change is set.
+static float update_row(float* restrict dst, const float* restrict src, long stride, long begin, long end, float keep, float weight, int track_change) {
+    long c = begin;
+    float max = 0;
+
+#if VECTOR_WIDTH > 1
+    vector keep_v = vector_set1(keep);
+    vector weight_v = vector_set1(weight);
+    vector max_v = vector_set1(0);
+    for (; c + VECTOR_WIDTH <= end; c += VECTOR_WIDTH) {
+        vector self = vector_load(src + c);
+        vector sum = vector_add(vector_add(vector_add(vector_load(src + c - 1), vector_load(src + c + 1)),
+            vector_load(src + c - stride)), vector_load(src + c + stride));
+#ifdef __FMA__
+        vector value = vector_fma(weight_v, sum, vector_mul(keep_v, self));
+#else
+        vector value = vector_add(vector_mul(weight_v, sum), vector_mul(keep_v, self));
+#endif
+        vector_store(dst + c, value);
+        if (track_change) {
+            max_v = vector_max(max_v, vector_abs(vector_sub(value, self)));
+        }
+    }
+    if (track_change) {
+        max = vector_reduce_max(max_v);
+    }
+#endif
+
+    for (; c < end; c++) {
+        float self = src[c];
+        float sum = src[c - 1] + src[c + 1] + src[c - stride] + src[c + stride];
+        float value = new_temperature(self, sum, keep, weight);
+        dst[c] = value;
+        if (track_change) {
+            float change = fabsf(value - self);
+            max = change > max ? change : max;
+        }
+    }
+    return max;
+}
+
+static float new_temperature(float self, float sum, float keep, float weight) {
+#ifdef __FMA__
+    return fmaf(weight, sum, keep * self);
+#else
+    return weight * sum + keep * self;
+#endif
+}
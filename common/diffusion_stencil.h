@@ -0,0 +1,31 @@
+#ifndef DIFFUSION_STENCIL_H
+#define DIFFUSION_STENCIL_H
+
+#include "diffusion_input.h"
+
+// Floating point operations per updated cell: three additions for the sum of the
+// neighbors, and a multiplication and a fused multiply-add to weigh it with the cell.
+#define DIFFUSION_STENCIL_FLOPS 6
+
+// Grids are row-major with rows of stride floats, and cell (r, c) of a region is at
+// m[r * stride + c]. Every cell of a region must have all four neighbors in memory,
+// which are read but never written.
+
+// Writes one iteration of heat diffusion with diffusion constant c of the cells of
+// region in src to dst. If max_change is not NULL, the largest absolute change of any
+// cell is written to it.
+void diffusion_stencil_apply(float* dst, const float* src, long stride, const struct diffusion_block* region, float c, float* max_change);
+
+// Copies the cells of region from src to dst, or zeroes them if src is NULL, with
+// the same split between threads as diffusion_stencil_apply. Each page of a fresh
+// dst then lands on the NUMA node of the thread that goes on to update it, as long
+// as the number of threads and their placement stay the same.
+void diffusion_stencil_first_touch(float* dst, const float* src, long stride, const struct diffusion_block* region);
+
+// Runs steps iterations in a single sweep over the rows, where iteration i updates
+// regions[i] from buffers[i % 2] to buffers[(i + 1) % 2]. Each iteration trails the
+// previous one by two rows, so the rows in flight stay in cache in between. Cells
+// outside of regions[i] must not change in iteration i.
+void diffusion_stencil_wavefront(float* buffers[2], long stride, const struct diffusion_block* regions, int steps, float c);
+
+#endif
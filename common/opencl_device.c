@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "opencl_device.h"
+
+#define MAX_PLATFORMS 16
+#define MAX_DEVICES 64
+#define INFO_LENGTH 256
+#define PATH_LENGTH 4096
+// Leaves room in a path for the name of a binary.
+#define DIR_LENGTH (PATH_LENGTH - 64)
+#define CACHE_DIRNAME "tma881-opencl"
+
+static int parse_device_index(const char* spec, unsigned int* platform_index, unsigned int* device_index);
+static int find_device(const char* spec, cl_platform_id* platform_id, cl_device_id* device_id);
+static int find_device_of_type(cl_device_type type, cl_platform_id* platform_id, cl_device_id* device_id);
+static cl_program load_cached_program(const struct opencl_device* d, const char* filename, const char* options);
+static void save_program_binary(cl_program program, const char* filename);
+static void print_build_log(const struct opencl_device* d, cl_program program);
+static int get_cache_filename(const struct opencl_device* d, const char* source, const char* options, char* filename);
+static int get_cache_dir(char* dir);
+static uint64_t hash_string(uint64_t hash, const char* s);
+
+int valid_opencl_device_spec(const char* spec) {
+    unsigned int platform_index, device_index;
+    return spec == NULL || strcmp(spec, "gpu") == 0 || strcmp(spec, "cpu") == 0
+        || strcmp(spec, "accelerator") == 0 || strcmp(spec, "any") == 0
+        || parse_device_index(spec, &platform_index, &device_index);
+}
+
+void open_opencl_device(const char* spec, struct opencl_device* d) {
+    if (spec == NULL) {
+        spec = "";
+    }
+    if (!find_device(spec, &d->platform_id, &d->device_id)) {
+        printf("could not find an OpenCL device for '%s'\n", spec);
+        exit(1);
+    }
+
+    cl_int error;
+    cl_context_properties properties[] = {
+        CL_CONTEXT_PLATFORM,
+        (cl_context_properties) d->platform_id,
+        0
+    };
+    d->context = clCreateContext(properties, 1, &d->device_id, NULL, NULL, &error);
+    assert_cl_success(error, "create context");
+    snprintf(d->spec, OPENCL_SPEC_LENGTH, "%s", spec);
+}
+
+void close_opencl_device(struct opencl_device* d) {
+    clReleaseContext(d->context);
+    d->context = NULL;
+}
+
+int opencl_device_matches(const struct opencl_device* d, const char* spec) {
+    return strcmp(d->spec, spec != NULL ? spec : "") == 0;
+}
+
+char* read_opencl_source(const char* filename) {
+    FILE* f = fopen(filename, "r");
+    if (f == NULL) {
+        printf("could not open file %s\n", filename);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    long fsize = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char* source = (char*) malloc(fsize + 1);
+    if (source == NULL) {
+        printf("could not allocate memory\n");
+        exit(1);
+    }
+    if (fread(source, 1, fsize, f) != (size_t) fsize) {
+        printf("could not read file %s\n", filename);
+        exit(1);
+    }
+    fclose(f);
+    source[fsize] = 0;
+    return source;
+}
+
+cl_program build_opencl_program(const struct opencl_device* d, const char* source, const char* options) {
+    char filename[PATH_LENGTH];
+    int cached = get_cache_filename(d, source, options, filename);
+    if (cached) {
+        cl_program program = load_cached_program(d, filename, options);
+        if (program != NULL) {
+            return program;
+        }
+    }
+
+    cl_int error;
+    cl_program program = clCreateProgramWithSource(d->context, 1, &source, NULL, &error);
+    assert_cl_success(error, "create program");
+    error = clBuildProgram(program, 1, &d->device_id, options, NULL, NULL);
+    if (error != CL_SUCCESS) {
+        print_build_log(d, program);
+        exit(1);
+    }
+
+    if (cached) {
+        save_program_binary(program, filename);
+    }
+    return program;
+}
+
+void assert_cl_success(cl_int error, const char* msg) {
+    if (error != CL_SUCCESS) {
+        printf("error: %s\n", msg);
+        exit(1);
+    }
+}
+
+// Parses "<platform>.<device>", returning 0 if spec is not of that form.
+static int parse_device_index(const char* spec, unsigned int* platform_index, unsigned int* device_index) {
+    int length;
+    return strlen(spec) < OPENCL_SPEC_LENGTH
+        && sscanf(spec, "%u.%u%n", platform_index, device_index, &length) == 2 && spec[length] == '\0';
+}
+
+// The empty spec stands for no spec.
+static int find_device(const char* spec, cl_platform_id* platform_id, cl_device_id* device_id) {
+    if (strcmp(spec, "") == 0) {
+        return find_device_of_type(CL_DEVICE_TYPE_GPU, platform_id, device_id)
+            || find_device_of_type(CL_DEVICE_TYPE_ALL, platform_id, device_id);
+    }
+    if (strcmp(spec, "gpu") == 0) {
+        return find_device_of_type(CL_DEVICE_TYPE_GPU, platform_id, device_id);
+    }
+    if (strcmp(spec, "cpu") == 0) {
+        return find_device_of_type(CL_DEVICE_TYPE_CPU, platform_id, device_id);
+    }
+    if (strcmp(spec, "accelerator") == 0) {
+        return find_device_of_type(CL_DEVICE_TYPE_ACCELERATOR, platform_id, device_id);
+    }
+    if (strcmp(spec, "any") == 0) {
+        return find_device_of_type(CL_DEVICE_TYPE_ALL, platform_id, device_id);
+    }
+
+    unsigned int platform_index, device_index;
+    if (!parse_device_index(spec, &platform_index, &device_index)) {
+        return 0;
+    }
+    cl_platform_id platforms[MAX_PLATFORMS];
+    cl_device_id devices[MAX_DEVICES];
+    cl_uint num_platforms, num_devices;
+    if (clGetPlatformIDs(MAX_PLATFORMS, platforms, &num_platforms) != CL_SUCCESS || platform_index >= num_platforms) {
+        return 0;
+    }
+    if (clGetDeviceIDs(platforms[platform_index], CL_DEVICE_TYPE_ALL, MAX_DEVICES, devices, &num_devices) != CL_SUCCESS || device_index >= num_devices) {
+        return 0;
+    }
+    *platform_id = platforms[platform_index];
+    *device_id = devices[device_index];
+    return 1;
+}
+
+static int find_device_of_type(cl_device_type type, cl_platform_id* platform_id, cl_device_id* device_id) {
+    cl_platform_id platforms[MAX_PLATFORMS];
+    cl_uint num_platforms;
+    if (clGetPlatformIDs(MAX_PLATFORMS, platforms, &num_platforms) != CL_SUCCESS) {
+        return 0;
+    }
+    for (cl_uint i = 0; i < num_platforms && i < MAX_PLATFORMS; i++) {
+        cl_uint num_devices;
+        if (clGetDeviceIDs(platforms[i], type, 1, device_id, &num_devices) == CL_SUCCESS && num_devices > 0) {
+            *platform_id = platforms[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Returns NULL if there is no usable binary, in which case the program is built from
+// source and the binary replaced.
+static cl_program load_cached_program(const struct opencl_device* d, const char* filename, const char* options) {
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    unsigned char* binary = (unsigned char*) malloc(size > 0 ? size : 1);
+    if (binary == NULL) {
+        printf("could not allocate memory\n");
+        exit(1);
+    }
+    size_t length = fread(binary, 1, size, f);
+    fclose(f);
+    if (size <= 0 || length != (size_t) size) {
+        free(binary);
+        return NULL;
+    }
+
+    cl_int error, status;
+    const unsigned char* binaries[] = {binary};
+    cl_program program = clCreateProgramWithBinary(d->context, 1, &d->device_id, &length, binaries, &status, &error);
+    free(binary);
+    if (error != CL_SUCCESS || status != CL_SUCCESS) {
+        return NULL;
+    }
+    if (clBuildProgram(program, 1, &d->device_id, options, NULL, NULL) != CL_SUCCESS) {
+        clReleaseProgram(program);
+        return NULL;
+    }
+    return program;
+}
+
+// The binary is written under another name and renamed, so that processes building
+// the same program at once never read half of one.
+static void save_program_binary(cl_program program, const char* filename) {
+    size_t size;
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL) != CL_SUCCESS || size == 0) {
+        return;
+    }
+    unsigned char* binary = (unsigned char*) malloc(size);
+    if (binary == NULL) {
+        printf("could not allocate memory\n");
+        exit(1);
+    }
+    unsigned char* binaries[] = {binary};
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL) == CL_SUCCESS) {
+        char tmp_filename[PATH_LENGTH + 32];
+        snprintf(tmp_filename, sizeof(tmp_filename), "%s.%d", filename, (int) getpid());
+        FILE* f = fopen(tmp_filename, "wb");
+        if (f != NULL) {
+            int written = fwrite(binary, 1, size, f) == size;
+            if (fclose(f) == 0 && written) {
+                rename(tmp_filename, filename);
+            } else {
+                unlink(tmp_filename);
+            }
+        }
+    }
+    free(binary);
+}
+
+static void print_build_log(const struct opencl_device* d, cl_program program) {
+    printf("cannot build program. log:\n");
+
+    size_t log_size = 0;
+    cl_int error = clGetProgramBuildInfo(program, d->device_id, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+    assert_cl_success(error, "get program build info");
+
+    char* log = calloc(log_size, sizeof(char));
+    if (log == NULL) {
+        printf("could not allocate memory\n");
+        exit(1);
+    }
+
+    error = clGetProgramBuildInfo(program, d->device_id, CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
+    assert_cl_success(error, "get program build info");
+    printf("%s\n", log);
+
+    free(log);
+}
+
+// Binaries are named by a hash of everything that goes into them. Returns 0 if there
+// is no cache to keep them in.
+static int get_cache_filename(const struct opencl_device* d, const char* source, const char* options, char* filename) {
+    char dir[DIR_LENGTH];
+    if (!get_cache_dir(dir)) {
+        return 0;
+    }
+
+    char platform_name[INFO_LENGTH] = "", platform_version[INFO_LENGTH] = "";
+    char device_name[INFO_LENGTH] = "", driver_version[INFO_LENGTH] = "";
+    clGetPlatformInfo(d->platform_id, CL_PLATFORM_NAME, INFO_LENGTH, platform_name, NULL);
+    clGetPlatformInfo(d->platform_id, CL_PLATFORM_VERSION, INFO_LENGTH, platform_version, NULL);
+    clGetDeviceInfo(d->device_id, CL_DEVICE_NAME, INFO_LENGTH, device_name, NULL);
+    clGetDeviceInfo(d->device_id, CL_DRIVER_VERSION, INFO_LENGTH, driver_version, NULL);
+
+    uint64_t hash = 14695981039346656037ULL;
+    hash = hash_string(hash, source);
+    hash = hash_string(hash, options != NULL ? options : "");
+    hash = hash_string(hash, platform_name);
+    hash = hash_string(hash, platform_version);
+    hash = hash_string(hash, device_name);
+    hash = hash_string(hash, driver_version);
+    snprintf(filename, PATH_LENGTH, "%s/%016llx.bin", dir, (unsigned long long) hash);
+    return 1;
+}
+
+static int get_cache_dir(char* dir) {
+    const char* cache_dir = getenv("OPENCL_CACHE_DIR");
+    const char* xdg_cache_home = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    if (cache_dir != NULL) {
+        if (cache_dir[0] == '\0') {
+            return 0;
+        }
+        snprintf(dir, DIR_LENGTH, "%s", cache_dir);
+    } else if (xdg_cache_home != NULL && xdg_cache_home[0] != '\0') {
+        snprintf(dir, DIR_LENGTH, "%s/%s", xdg_cache_home, CACHE_DIRNAME);
+    } else if (home != NULL && home[0] != '\0') {
+        char parent[DIR_LENGTH - 32];
+        snprintf(parent, sizeof(parent), "%s/.cache", home);
+        mkdir(parent, 0755);
+        snprintf(dir, DIR_LENGTH, "%s/%s", parent, CACHE_DIRNAME);
+    } else {
+        return 0;
+    }
+    return mkdir(dir, 0755) == 0 || errno == EEXIST;
+}
+
+// 64-bit FNV-1a, with the terminating NUL so that the strings cannot run together.
+static uint64_t hash_string(uint64_t hash, const char* s) {
+    do {
+        hash ^= (unsigned char) *s;
+        hash *= 1099511628211ULL;
+    } while (*s++ != '\0');
+    return hash;
+}
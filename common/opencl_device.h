@@ -0,0 +1,48 @@
+#ifndef OPENCL_DEVICE_H
+#define OPENCL_DEVICE_H
+
+#ifndef CL_TARGET_OPENCL_VERSION
+#define CL_TARGET_OPENCL_VERSION 220
+#endif
+
+#include <CL/cl.h>
+
+// A device is picked by type, the first one of it on any platform, or by its index
+// among the devices of the platform with the given index. Without a spec, the first
+// GPU is picked if there is one, and otherwise the first device of any type, so the
+// same kernels run on PoCL or Intel's CPU runtime on nodes without a GPU.
+#define OPENCL_DEVICE_USAGE "gpu|cpu|accelerator|any|<platform>.<device>"
+#define OPENCL_SPEC_LENGTH 32
+
+struct opencl_device {
+    cl_platform_id platform_id;
+    cl_device_id device_id;
+    cl_context context;
+    char spec[OPENCL_SPEC_LENGTH];
+};
+
+// Whether spec, which may be NULL, is one of the above.
+int valid_opencl_device_spec(const char* spec);
+
+// Picks a device by a valid spec and creates a context on it, or exits if there is
+// no such device.
+void open_opencl_device(const char* spec, struct opencl_device* d);
+void close_opencl_device(struct opencl_device* d);
+
+// Whether d was opened with spec, so that a warm engine can tell whether a job asks
+// for another device.
+int opencl_device_matches(const struct opencl_device* d, const char* spec);
+
+// Reads the source of a program into a NUL-terminated string, freed with free.
+char* read_opencl_source(const char* filename);
+
+// Builds a program from source with options, or loads it from the binary built by
+// an earlier run with the same source, options, device and driver. Binaries are
+// kept in $OPENCL_CACHE_DIR, or $XDG_CACHE_HOME/tma881-opencl, or
+// ~/.cache/tma881-opencl, and an empty $OPENCL_CACHE_DIR turns the cache off.
+// Prints the build log and exits if the program does not build.
+cl_program build_opencl_program(const struct opencl_device* d, const char* source, const char* options);
+
+void assert_cl_success(cl_int error, const char* msg);
+
+#endif
@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "placement.h"
+
+struct cpu_topology {
+    int cpu;
+    int package;
+    int core;
+    int sibling;
+    int slot;
+};
+
+static int get_allowed_cpus(int* cpus);
+static int parse_cpu_list(const char* spec, int* cpus);
+static int is_allowed_cpu(int cpu);
+static void order_cpus(int* cpus, int n, int scatter);
+static int read_topology_id(int cpu, const char* name, int fallback);
+static int compare_compact(const void* a, const void* b);
+static int compare_scatter(const void* a, const void* b);
+
+// The CPUs the process may run on, before any thread is pinned.
+static int allowed_cpus[CPU_SETSIZE];
+static int num_allowed = -1;
+
+int parse_placement(const char* spec, struct placement* p) {
+    if (num_allowed == -1) {
+        num_allowed = get_allowed_cpus(allowed_cpus);
+    }
+
+    p->cpus = (int*) malloc(sizeof(int) * CPU_SETSIZE);
+    if (p->cpus == NULL) {
+        printf("could not allocate memory\n");
+        exit(1);
+    }
+    if (spec == NULL || strcmp(spec, "compact") == 0 || strcmp(spec, "scatter") == 0) {
+        p->mode = spec == NULL ? PLACEMENT_NONE : spec[0] == 'c' ? PLACEMENT_COMPACT : PLACEMENT_SCATTER;
+        p->num_cpus = num_allowed;
+        memcpy(p->cpus, allowed_cpus, sizeof(int) * num_allowed);
+        if (p->mode != PLACEMENT_NONE) {
+            order_cpus(p->cpus, p->num_cpus, p->mode == PLACEMENT_SCATTER);
+        }
+        return 0;
+    }
+
+    p->mode = PLACEMENT_LIST;
+    p->num_cpus = parse_cpu_list(spec, p->cpus);
+    if (p->num_cpus <= 0) {
+        free_placement(p);
+        return -1;
+    }
+    return 0;
+}
+
+void free_placement(struct placement* p) {
+    free(p->cpus);
+    p->cpus = NULL;
+    p->num_cpus = 0;
+}
+
+void pin_thread(const struct placement* p, int i) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (p->mode == PLACEMENT_NONE) {
+        for (int j = 0; j < p->num_cpus; j++) {
+            CPU_SET(p->cpus[j], &set);
+        }
+    } else {
+        CPU_SET(p->cpus[i % p->num_cpus], &set);
+    }
+    int ret;
+    if (p->num_cpus > 0 && (ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0) {
+        printf("could not set the cpu affinity of thread %d: %s\n", i, strerror(ret));
+    }
+}
+
+void* placement_alloc(size_t size, int huge_pages) {
+    size_t rounded = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    void* p = aligned_alloc(HUGE_PAGE_SIZE, rounded > 0 ? rounded : HUGE_PAGE_SIZE);
+    if (p == NULL) {
+        printf("could not allocate memory\n");
+        exit(1);
+    }
+    if (huge_pages) {
+        advise_huge_pages(p, rounded);
+    }
+    return p;
+}
+
+void advise_huge_pages(void* p, size_t size) {
+    char* begin = (char*) (((size_t) p + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+    char* end = (char*) (((size_t) p + size) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+    if (end > begin) {
+        madvise(begin, end - begin, MADV_HUGEPAGE);
+    }
+}
+
+static int get_allowed_cpus(int* cpus) {
+    cpu_set_t set;
+    int n = 0;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        cpus[0] = 0;
+        return 1;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+            cpus[n++] = cpu;
+        }
+    }
+    return n;
+}
+
+// Returns the number of CPUs in a list of CPUs and ranges like "0-3,8", or -1 if it
+// is not one or names a CPU the process may not run on.
+static int parse_cpu_list(const char* spec, int* cpus) {
+    int n = 0;
+    const char* p = spec;
+    while (*p != '\0') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0) {
+            return -1;
+        }
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) {
+                return -1;
+            }
+            p = end;
+        }
+        if (last >= CPU_SETSIZE || n + last - first + 1 > CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (!is_allowed_cpu(cpu)) {
+                return -1;
+            }
+            cpus[n++] = cpu;
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0') {
+            return -1;
+        }
+    }
+    return n;
+}
+
+static int is_allowed_cpu(int cpu) {
+    for (int i = 0; i < num_allowed; i++) {
+        if (allowed_cpus[i] == cpu) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The sibling of a CPU is its rank among the hardware threads of its core, and its
+// slot its rank among the allowed CPUs of its package in compact order.
+static void order_cpus(int* cpus, int n, int scatter) {
+    struct cpu_topology topology[n];
+    for (int i = 0; i < n; i++) {
+        topology[i].cpu = cpus[i];
+        topology[i].package = read_topology_id(cpus[i], "physical_package_id", 0);
+        topology[i].core = read_topology_id(cpus[i], "core_id", cpus[i]);
+        topology[i].sibling = 0;
+        for (int j = 0; j < i; j++) {
+            if (topology[j].package == topology[i].package && topology[j].core == topology[i].core) {
+                topology[i].sibling++;
+            }
+        }
+    }
+
+    qsort(topology, n, sizeof(struct cpu_topology), compare_compact);
+    for (int i = 0; i < n; i++) {
+        topology[i].slot = i > 0 && topology[i - 1].package == topology[i].package ? topology[i - 1].slot + 1 : 0;
+    }
+    if (scatter) {
+        qsort(topology, n, sizeof(struct cpu_topology), compare_scatter);
+    }
+    for (int i = 0; i < n; i++) {
+        cpus[i] = topology[i].cpu;
+    }
+}
+
+// Returns fallback where the kernel does not say, as in some virtual machines.
+static int read_topology_id(int cpu, const char* name, int fallback) {
+    char filename[128];
+    snprintf(filename, sizeof(filename), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    FILE* fp = fopen(filename, "r");
+    if (fp == NULL) {
+        return fallback;
+    }
+    int id;
+    if (fscanf(fp, "%d", &id) != 1 || id < 0) {
+        id = fallback;
+    }
+    fclose(fp);
+    return id;
+}
+
+static int compare_compact(const void* a, const void* b) {
+    const struct cpu_topology* x = (const struct cpu_topology*) a;
+    const struct cpu_topology* y = (const struct cpu_topology*) b;
+    if (x->package != y->package) {
+        return x->package - y->package;
+    }
+    if (x->sibling != y->sibling) {
+        return x->sibling - y->sibling;
+    }
+    if (x->core != y->core) {
+        return x->core - y->core;
+    }
+    return x->cpu - y->cpu;
+}
+
+static int compare_scatter(const void* a, const void* b) {
+    const struct cpu_topology* x = (const struct cpu_topology*) a;
+    const struct cpu_topology* y = (const struct cpu_topology*) b;
+    if (x->slot != y->slot) {
+        return x->slot - y->slot;
+    }
+    return x->package - y->package;
+}
@@ -0,0 +1,59 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <stddef.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Where the threads of an engine run. Compact fills one socket before the next,
+// with one thread per core before the second hardware thread of any core, so that
+// few threads share the memory bandwidth of many sockets. Scatter spreads
+// consecutive threads over the sockets, so that any number of threads uses them
+// all. A list gives the CPUs themselves. Only the CPUs the process was allowed to
+// run on when the placement was first parsed are used, so that the threads of an
+// MPI rank bound to a socket stay on it, and thread i runs on cpus[i % num_cpus].
+enum placement_mode {
+    PLACEMENT_NONE,
+    PLACEMENT_COMPACT,
+    PLACEMENT_SCATTER,
+    PLACEMENT_LIST,
+};
+
+#define PLACEMENT_USAGE "compact|scatter|<cpu list>"
+#define HUGE_PAGE_SIZE (2 << 20)
+
+struct placement {
+    enum placement_mode mode;
+    int num_cpus;
+    int* cpus;
+};
+
+// Parses "compact", "scatter" or a list of CPUs like "0-3,8", or sets up no
+// placement if spec is NULL. Returns -1 if spec is none of those, or lists a CPU
+// the process is not allowed to run on.
+int parse_placement(const char* spec, struct placement* p);
+void free_placement(struct placement* p);
+
+// Pins the calling thread to the CPU of thread i, or lets it run on all of the
+// allowed CPUs again without a placement, in case an earlier job pinned it.
+void pin_thread(const struct placement* p, int i);
+
+// Allocates size bytes aligned to huge pages, and backed by them if huge_pages is
+// set and the kernel has transparent huge pages. The pages are not touched, so each
+// lands on the NUMA node of the thread that writes it first. Freed with free.
+void* placement_alloc(size_t size, int huge_pages);
+
+// Asks for huge pages for the part of [p, p + size) that is made of whole ones.
+void advise_huge_pages(void* p, size_t size);
+
+#ifdef _OPENMP
+// The OpenMP threads are kept between parallel regions, and stay pinned as long
+// as the number of threads does not change.
+static inline void pin_openmp_threads(const struct placement* p) {
+    #pragma omp parallel
+    pin_thread(p, omp_get_thread_num());
+}
+#endif
+
+#endif
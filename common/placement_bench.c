@@ -0,0 +1,157 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <omp.h>
+
+#include "placement.h"
+
+#define COPY_REPEATS 10
+#define PAGE_SAMPLES 4096
+
+enum touch {
+    TOUCH_SERIAL,
+    TOUCH_PARALLEL,
+    TOUCH_SHIFTED,
+};
+
+void measure(const char* name, long n, enum touch touch, int huge_pages, const int* thread_nodes);
+void get_range(long n, int thread, int num_threads, long* begin, long* end);
+double copy_bandwidth(float* dst, const float* src, long n);
+double local_fraction(float* m, long n, const int* thread_nodes);
+int get_node();
+
+// Compares the memory bandwidth of the threads on two arrays whose pages were first
+// touched by the main thread, as when a grid is zero-filled serially, with arrays
+// touched by the threads that copy them, and with arrays touched by the next thread
+// over, which with scatter placement is on another socket. The fraction of pages
+// on the NUMA node of the thread that copies them is checked with move_pages.
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argc > 3 || atol(argv[1]) <= 0) {
+        printf("Usage: ./placement_bench <megabytes per array> [" PLACEMENT_USAGE "]\n");
+        return 1;
+    }
+    long n = atol(argv[1]) * (1 << 20) / sizeof(float);
+
+    struct placement placement;
+    if (parse_placement(argc == 3 ? argv[2] : "scatter", &placement) != 0) {
+        printf("Usage: ./placement_bench <megabytes per array> [" PLACEMENT_USAGE "]\n");
+        return 1;
+    }
+    pin_openmp_threads(&placement);
+
+    int num_threads = omp_get_max_threads();
+    int thread_nodes[num_threads];
+    #pragma omp parallel
+    thread_nodes[omp_get_thread_num()] = get_node();
+
+    printf("%d threads on CPUs", num_threads);
+    for (int t = 0; t < num_threads; t++) {
+        printf(" %d", placement.cpus[t % placement.num_cpus]);
+    }
+    printf(", two arrays of %ld MB\n", atol(argv[1]));
+
+    measure("serial first touch", n, TOUCH_SERIAL, 0, thread_nodes);
+    measure("parallel first touch", n, TOUCH_PARALLEL, 0, thread_nodes);
+    measure("parallel first touch, huge pages", n, TOUCH_PARALLEL, 1, thread_nodes);
+    measure("touched by the next thread", n, TOUCH_SHIFTED, 0, thread_nodes);
+
+    free_placement(&placement);
+    return 0;
+}
+
+void measure(const char* name, long n, enum touch touch, int huge_pages, const int* thread_nodes) {
+    float* src = (float*) placement_alloc(sizeof(float) * n, huge_pages);
+    float* dst = (float*) placement_alloc(sizeof(float) * n, huge_pages);
+
+    if (touch == TOUCH_SERIAL) {
+        memset(src, 0, sizeof(float) * n);
+        memset(dst, 0, sizeof(float) * n);
+    } else {
+        int shift = touch == TOUCH_SHIFTED;
+        #pragma omp parallel
+        {
+            long begin, end;
+            get_range(n, (omp_get_thread_num() + shift) % omp_get_num_threads(), omp_get_num_threads(), &begin, &end);
+            memset(src + begin, 0, sizeof(float) * (end - begin));
+            memset(dst + begin, 0, sizeof(float) * (end - begin));
+        }
+    }
+
+    double bandwidth = copy_bandwidth(dst, src, n);
+    double local = local_fraction(src, n, thread_nodes);
+    printf("%s: %.2f GB/s", name, bandwidth / 1e9);
+    if (local >= 0) {
+        printf(", %.0f%% of pages local", 100 * local);
+    }
+    printf("\n");
+
+    free(src);
+    free(dst);
+}
+
+// Thread t of num_threads copies elements [begin, end).
+void get_range(long n, int thread, int num_threads, long* begin, long* end) {
+    *begin = n * thread / num_threads;
+    *end = n * (thread + 1) / num_threads;
+}
+
+// The best of a few parallel copies, counting the read and the write.
+double copy_bandwidth(float* dst, const float* src, long n) {
+    double best = 0;
+    for (int r = 0; r < COPY_REPEATS; r++) {
+        double start = omp_get_wtime();
+        #pragma omp parallel
+        {
+            long begin, end;
+            get_range(n, omp_get_thread_num(), omp_get_num_threads(), &begin, &end);
+            memcpy(dst + begin, src + begin, sizeof(float) * (end - begin));
+        }
+        double bandwidth = 2 * sizeof(float) * n / (omp_get_wtime() - start);
+        best = bandwidth > best ? bandwidth : best;
+    }
+    return best;
+}
+
+// The fraction of a sample of the pages of m that are on the node of the thread
+// that copies them, or -1 if the kernel does not say.
+double local_fraction(float* m, long n, const int* thread_nodes) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    long num_pages = (sizeof(float) * n + page_size - 1) / page_size;
+    long num_samples = num_pages < PAGE_SAMPLES ? num_pages : PAGE_SAMPLES;
+    void* pages[num_samples];
+    int status[num_samples];
+    for (long i = 0; i < num_samples; i++) {
+        pages[i] = (char*) m + i * num_pages / num_samples * page_size;
+    }
+    if (syscall(SYS_move_pages, 0, num_samples, pages, NULL, status, 0) != 0) {
+        return -1;
+    }
+
+    int num_threads = omp_get_max_threads();
+    long local = 0, known = 0;
+    for (long i = 0; i < num_samples; i++) {
+        long element = ((char*) pages[i] - (char*) m) / sizeof(float);
+        int thread = (int) (element * num_threads / n);
+        while (thread + 1 < num_threads && element >= n * (thread + 1) / num_threads) {
+            thread++;
+        }
+        if (status[i] >= 0) {
+            known++;
+            local += status[i] == thread_nodes[thread];
+        }
+    }
+    return known > 0 ? (double) local / known : -1;
+}
+
+// The NUMA node of the CPU the calling thread runs on.
+int get_node() {
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+        return -1;
+    }
+    return node;
+}
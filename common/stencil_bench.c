@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <omp.h>
+
+#include "diffusion_stencil.h"
+
+#define DIFFUSION_CONSTANT 0.1f
+#define COPY_REPEATS 10
+
+double time_apply(float* buffers[2], long stride, struct diffusion_block* region, long iterations);
+double time_wavefront(float* buffers[2], long stride, struct diffusion_block* region, long iterations, int steps);
+double copy_bandwidth(float* dst, const float* src, long n);
+void report(const char* name, double seconds, long cells, long iterations, double stream);
+
+// Times the heat diffusion stencil on a random rows * cols grid. The effective
+// bandwidth counts one read and one write of every cell per iteration, which is all
+// the memory traffic there would be with perfect caching, and is compared to the
+// bandwidth of a plain copy between two arrays of the same size as the grid.
+int main(int argc, char* argv[]) {
+    if (argc < 4 || argc > 5) {
+        printf("Usage: ./stencil_bench <rows> <cols> <iterations> [<wavefront steps>]\n");
+        return 1;
+    }
+    long rows = atol(argv[1]);
+    long cols = atol(argv[2]);
+    long iterations = atol(argv[3]);
+    int steps = argc == 5 ? atoi(argv[4]) : 0;
+    if (rows <= 0 || cols <= 0 || iterations <= 0 || steps < 0) {
+        printf("Usage: ./stencil_bench <rows> <cols> <iterations> [<wavefront steps>]\n");
+        return 1;
+    }
+
+    long stride = cols + 2;
+    long n = (rows + 2) * stride;
+    float* matrices[2] = {(float*) malloc(sizeof(float) * n), (float*) malloc(sizeof(float) * n)};
+    if (matrices[0] == NULL || matrices[1] == NULL) {
+        printf("could not allocate memory\n");
+        return 1;
+    }
+
+    // Touch the pages from the threads that update them.
+    #pragma omp parallel
+    {
+        unsigned int seed = omp_get_thread_num() + 1;
+        #pragma omp for schedule(static)
+        for (long i = 0; i < n; i++) {
+            matrices[0][i] = (float) rand_r(&seed) / RAND_MAX;
+            matrices[1][i] = matrices[0][i];
+        }
+    }
+
+    float* buffers[2] = {matrices[0] + stride + 1, matrices[1] + stride + 1};
+    struct diffusion_block region = {0, rows, 0, cols};
+    printf("%ld x %ld cells, %ld iterations, %d threads\n", rows, cols, iterations, omp_get_max_threads());
+
+    double stream = copy_bandwidth(matrices[1], matrices[0], n);
+    printf("copy: %.2f GB/s\n", stream / 1e9);
+
+    time_apply(buffers, stride, &region, 1);
+    report("stencil", time_apply(buffers, stride, &region, iterations), rows * cols, iterations, stream);
+    if (steps > 0) {
+        report("wavefront", time_wavefront(buffers, stride, &region, iterations, steps), rows * cols, iterations, stream);
+    }
+
+    free(matrices[0]);
+    free(matrices[1]);
+    return 0;
+}
+
+double time_apply(float* buffers[2], long stride, struct diffusion_block* region, long iterations) {
+    double start = omp_get_wtime();
+    for (long i = 0; i < iterations; i++) {
+        diffusion_stencil_apply(buffers[(i + 1) % 2], buffers[i % 2], stride, region, DIFFUSION_CONSTANT, NULL);
+    }
+    return omp_get_wtime() - start;
+}
+
+// Runs the iterations in sweeps of the given number of steps, the last of which may
+// be shorter.
+double time_wavefront(float* buffers[2], long stride, struct diffusion_block* region, long iterations, int steps) {
+    struct diffusion_block regions[steps];
+    for (int i = 0; i < steps; i++) {
+        regions[i] = *region;
+    }
+
+    double start = omp_get_wtime();
+    int current = 0;
+    for (long i = 0; i < iterations; i += steps) {
+        int n = iterations - i < steps ? iterations - i : steps;
+        float* sweep[2] = {buffers[current], buffers[1 - current]};
+        diffusion_stencil_wavefront(sweep, stride, regions, n, DIFFUSION_CONSTANT);
+        current = (current + n) % 2;
+    }
+    return omp_get_wtime() - start;
+}
+
+// The best of a few parallel copies, counting the read and the write.
+double copy_bandwidth(float* dst, const float* src, long n) {
+    double best = 0;
+    for (int r = 0; r < COPY_REPEATS; r++) {
+        double start = omp_get_wtime();
+        #pragma omp parallel for schedule(static)
+        for (long i = 0; i < n; i++) {
+            dst[i] = src[i];
+        }
+        double bandwidth = 2 * sizeof(float) * n / (omp_get_wtime() - start);
+        best = bandwidth > best ? bandwidth : best;
+    }
+    return best;
+}
+
+void report(const char* name, double seconds, long cells, long iterations, double stream) {
+    double updates = (double) cells * iterations;
+    double bandwidth = 2 * sizeof(float) * updates / seconds;
+    printf("%s: %.3f s, %.2f GFLOP/s, %.2f GB/s effective, %.0f%% of copy\n", name, seconds,
+        DIFFUSION_STENCIL_FLOPS * updates / seconds / 1e9, bandwidth / 1e9, 100 * bandwidth / stream);
+}
@@ -6,14 +6,24 @@
 #include <stdbool.h> 
 #include <getopt.h> 
 #include <pthread.h> 
+#include <limits.h>
+#include <unistd.h>
 
+#include "compute_service.h"
+#include "placement.h"
+#ifdef USE_OPENCL
+#include "opencl_device.h"
+#endif
+
+int newton_job(int argc, char* argv[]);
 void parse_args(int argc, char* argv[]);
 void print_complex_double(double complex dbl);
 void init_roots();
 void init_results_vars();
 void free_vars();
-void start_threads(pthread_t* threads);
-void join_threads(pthread_t* threads);
+void run_threads();
+void start_pool_threads(int size);
+void* pool_thread_main(void* restrict arg);
 void* worker_thread_main(void* restrict arg);
 struct result newton(double complex x);
 bool illegal_value(double complex x);
@@ -24,6 +34,10 @@ double complex f_deriv(double complex x);
 void* writer_thread_main(void* restrict arg);
 void write_file_headers(FILE* fp_attractors, FILE* fp_convergence);
 void write_file_bodies(FILE* fp_attractors, FILE* fp_convergence);
+int valid_device_spec(const char* device_spec);
+void read_program_source();
+void run_kernels();
+void release_engine();
 
 #define OUT_OF_BOUNDS 10000000000
 #define ERROR_MARGIN 0.001
@@ -34,6 +48,9 @@ void write_file_bodies(FILE* fp_attractors, FILE* fp_convergence);
 #define COLOR_TRIPLET_LEN 12
 #define GRAYSCALE_COLOR_LEN 4
 #define SLEEP_NSEC 5
+#define PROGRAM_FILENAME "newton.cl"
+#define MAX_ROOTS 9
+#define CL_BLOCK_ROWS 64
 
 size_t picture_size;
 char poly_degree;
@@ -43,6 +60,13 @@ double complex* roots;
 
 char num_threads;
 
+// Pool thread i runs on the CPU of thread i of the placement.
+struct placement placement;
+bool huge_pages;
+
+// With a device, the pixels are iterated on it instead of by the workers.
+char* device_spec;
+
 struct result {
     char root;
     char iterations;
@@ -53,15 +77,64 @@ struct result** results;
 bool* ready;
 pthread_mutex_t ready_mutex;
 
+// The threads outlive a job, so that a served job only starts the threads it needs
+// beyond those started by earlier jobs. Every job increments the generation, and pool
+// thread i then runs worker i, or the writer if i is num_threads, or nothing.
+struct pool_thread {
+    pthread_t thread;
+    int index;
+    unsigned long generation;
+};
+
+// One more than the most workers, for the writer.
+struct pool_thread pool[CHAR_MAX + 1];
+int pool_size;
+int pool_busy;
+unsigned long pool_generation;
+pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+
+#ifdef USE_OPENCL
+// The OpenCL objects that are kept between the jobs of a served program, as in lab_4.
+// A job that asks for another device gets a new engine.
+struct engine {
+    int initialized;
+    struct opencl_device device;
+    char* source;
+    cl_program program;
+    cl_kernel kernel;
+    cl_command_queue command_queue;
+    cl_mem roots_re;
+    cl_mem roots_im;
+    cl_mem blocks[2];
+    size_t block_capacity;
+};
+
+struct engine engine;
+#endif
+
 int main(int argc, char* argv[]) {
+    const char* path = compute_service_path(argc, argv);
+    if (path != NULL) {
+        return compute_serve(path, argv[0], newton_job, read_program_source);
+    }
+    int status = newton_job(argc, argv);
+    release_engine();
+    return status;
+}
+
+int newton_job(int argc, char* argv[]) {
     parse_args(argc, argv);
 
     init_roots();
     init_results_vars();
 
-    pthread_t threads[num_threads + 1];
-    start_threads(threads);
-    join_threads(threads);
+    // With a device, the pool only runs the writer.
+    if (device_spec != NULL) {
+        num_threads = 0;
+    }
+    run_threads();
 
     free_vars();
 
@@ -69,8 +142,13 @@ int main(int argc, char* argv[]) {
 }
 
 void parse_args(int argc, char* argv[]) {
+    num_threads = 0;
+    picture_size = 0;
+    huge_pages = false;
+    device_spec = NULL;
+    char* placement_spec = NULL;
     int option;
-    while ((option = getopt(argc, argv, "t:l:")) != -1) {
+    while ((option = getopt(argc, argv, "t:l:a:HD:")) != -1) {
         switch (option) {
             case 't':
                 num_threads = atoi(optarg);
@@ -78,11 +156,24 @@ void parse_args(int argc, char* argv[]) {
             case 'l':
                 picture_size = atoi(optarg);
                 break;
+            case 'a':
+                placement_spec = optarg;
+                break;
+            case 'H':
+                huge_pages = true;
+                break;
+            case 'D':
+                device_spec = optarg;
+                break;
             default:
-                printf("Usage: ./newton -t<num_thread> -l<picture_size> <poly_degree>");
+                printf("Usage: ./newton -t<num_thread> -l<picture_size> [-a<placement>] [-H] [-D<device>] <poly_degree>");
                 exit(1);
         }
     }
+    if (parse_placement(placement_spec, &placement) != 0 || !valid_device_spec(device_spec)) {
+        printf("Usage: ./newton -t<num_thread> -l<picture_size> [-a<placement>] [-H] [-D<device>] <poly_degree>");
+        exit(1);
+    }
     poly_degree = atoi(argv[argc - 1]);
 }
 
@@ -152,8 +243,10 @@ void init_roots() {
     }
 }
 
+// The results are left untouched, so that each row lands on the NUMA node of the
+// worker that computes it.
 void init_results_vars() {
-    results_values = (struct result*) malloc(sizeof(struct result) * picture_size * picture_size);
+    results_values = (struct result*) placement_alloc(sizeof(struct result) * picture_size * picture_size, huge_pages);
     results = (struct result**) malloc(sizeof(struct result*) * picture_size);
     for (size_t i = 0, j = 0; i < picture_size; i++, j += picture_size) {
         results[i] = results_values + j;
@@ -170,39 +263,74 @@ void free_vars() {
     free(results);
     free(results_values);
     free(ready);
+    free_placement(&placement);
     pthread_mutex_destroy(&ready_mutex);
 }
 
-void start_threads(pthread_t* threads) {
-    int ret;
-    for (char i = 0; i < num_threads; i++) {
-        char* arg = (char*) malloc(sizeof(char));
-        *arg = i;
-        if ((ret = pthread_create(threads + i, NULL, worker_thread_main, (void*) arg))) {
-            printf("Error creating worker thread: %d\n", ret);
-            exit(1);
-        }
+void run_threads() {
+    start_pool_threads(num_threads + 1);
+
+    pthread_mutex_lock(&pool_mutex);
+    pool_generation++;
+    pool_busy = pool_size;
+    pthread_cond_broadcast(&pool_start);
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (device_spec != NULL) {
+        run_kernels();
     }
 
-    if ((ret = pthread_create(threads + num_threads, NULL, writer_thread_main, NULL))) {
-        printf("Error creating writer thread: %d\n", ret);
-        exit(1);
+    pthread_mutex_lock(&pool_mutex);
+    while (pool_busy > 0) {
+        pthread_cond_wait(&pool_done, &pool_mutex);
     }
+    pthread_mutex_unlock(&pool_mutex);
 }
 
-void join_threads(pthread_t* threads){
+void start_pool_threads(int size) {
     int ret;
-    for (char i = 0; i < num_threads + 1; i++) {
-        if ((ret = pthread_join(threads[i], NULL))) {
-            printf("Error joining thread: %d\n", ret);
+    for (; pool_size < size; pool_size++) {
+        struct pool_thread* t = pool + pool_size;
+        t->index = pool_size;
+        t->generation = pool_generation;
+        if ((ret = pthread_create(&t->thread, NULL, pool_thread_main, (void*) t))) {
+            printf("Error creating thread: %d\n", ret);
             exit(1);
         }
     }
 }
 
+void* pool_thread_main(void* restrict arg) {
+    struct pool_thread* t = (struct pool_thread*) arg;
+
+    pthread_mutex_lock(&pool_mutex);
+    while (true) {
+        while (t->generation == pool_generation) {
+            pthread_cond_wait(&pool_start, &pool_mutex);
+        }
+        t->generation = pool_generation;
+        pthread_mutex_unlock(&pool_mutex);
+
+        char offset = t->index;
+        if (t->index <= num_threads) {
+            pin_thread(&placement, t->index);
+        }
+        if (t->index < num_threads) {
+            worker_thread_main(&offset);
+        } else if (t->index == num_threads) {
+            writer_thread_main(NULL);
+        }
+
+        pthread_mutex_lock(&pool_mutex);
+        if (--pool_busy == 0) {
+            pthread_cond_signal(&pool_done);
+        }
+    }
+    return NULL;
+}
+
 void* worker_thread_main(void* restrict arg) {
     char offset = *((char*) arg);
-    free(arg);
 
     struct result row_results[picture_size];
 
@@ -343,7 +471,12 @@ void write_file_bodies(FILE* fp_attractors, FILE* fp_convergence) {
     size_t buf_attractors_len = picture_size * COLOR_TRIPLET_LEN + 1;
     size_t buf_convergence_len = picture_size * GRAYSCALE_COLOR_LEN + 1;
 
+    // Nothing is ready until it has been copied from ready, not even in a served job,
+    // whose stack may still hold the previous job's copy.
     bool ready_loc[picture_size];
+    for (size_t i = 0; i < picture_size; i++) {
+        ready_loc[i] = false;
+    }
     struct timespec sleep_timespec;
     sleep_timespec.tv_sec = 0;
     sleep_timespec.tv_nsec = SLEEP_NSEC;
@@ -384,3 +517,151 @@ void write_file_bodies(FILE* fp_attractors, FILE* fp_convergence) {
         }
     }
 }
+
+#ifdef USE_OPENCL
+int valid_device_spec(const char* device_spec) {
+    return valid_opencl_device_spec(device_spec);
+}
+
+void read_program_source() {
+    if (engine.source == NULL && access(PROGRAM_FILENAME, R_OK) == 0) {
+        engine.source = read_opencl_source(PROGRAM_FILENAME);
+    }
+}
+
+void init_cl(struct engine* e, const char* device_spec) {
+    if (e->initialized && opencl_device_matches(&e->device, device_spec)) {
+        return;
+    }
+    release_engine();
+    cl_int error;
+
+    // Pick the device, and build the kernel, or load it from the binary cache.
+    open_opencl_device(device_spec, &e->device);
+    if (e->source == NULL) {
+        e->source = read_opencl_source(PROGRAM_FILENAME);
+    }
+    char options[256];
+    snprintf(options, sizeof(options), "-DOUT_OF_BOUNDS=%.17g -DERROR_MARGIN_2=%.17g -DX_MIN=%.17g -DMAX_ITERATIONS=%d",
+             (double) OUT_OF_BOUNDS, ERROR_MARGIN_2, X_MIN, MAX_ITERATIONS);
+    e->program = build_opencl_program(&e->device, e->source, options);
+
+    e->kernel = clCreateKernel(e->program, "newton", &error);
+    assert_cl_success(error, "create kernel");
+    e->command_queue = clCreateCommandQueueWithProperties(e->device.context, e->device.device_id, NULL, &error);
+    assert_cl_success(error, "create command queue");
+
+    e->roots_re = clCreateBuffer(e->device.context, CL_MEM_READ_ONLY, sizeof(cl_double) * MAX_ROOTS, NULL, &error);
+    assert_cl_success(error, "create cl roots buffer");
+    e->roots_im = clCreateBuffer(e->device.context, CL_MEM_READ_ONLY, sizeof(cl_double) * MAX_ROOTS, NULL, &error);
+    assert_cl_success(error, "create cl roots buffer");
+    e->initialized = 1;
+}
+
+// The block buffers only grow, so that served jobs with smaller pictures reuse them.
+void reserve_blocks(struct engine* e, size_t size) {
+    if (size <= e->block_capacity) {
+        return;
+    }
+    cl_int error;
+    for (int i = 0; i < 2; i++) {
+        if (e->blocks[i] != NULL) {
+            clReleaseMemObject(e->blocks[i]);
+        }
+        e->blocks[i] = clCreateBuffer(e->device.context, CL_MEM_WRITE_ONLY, size, NULL, &error);
+        assert_cl_success(error, "create cl block buffer");
+    }
+    e->block_capacity = size;
+}
+
+// Blocks of rows are computed into two buffers in turn, so that the device computes a
+// block while the one before it is read back and written out by the writer.
+void run_kernels() {
+    struct engine* e = &engine;
+    init_cl(e, device_spec);
+    reserve_blocks(e, sizeof(struct result) * picture_size * CL_BLOCK_ROWS);
+
+    cl_double roots_re[MAX_ROOTS];
+    cl_double roots_im[MAX_ROOTS];
+    for (int i = 0; i < num_roots; i++) {
+        roots_re[i] = creal(roots[i]);
+        roots_im[i] = cimag(roots[i]);
+    }
+    cl_int error = clEnqueueWriteBuffer(e->command_queue, e->roots_re, CL_TRUE, 0, sizeof(cl_double) * num_roots, roots_re, 0, NULL, NULL);
+    assert_cl_success(error, "write to cl roots buffer");
+    error = clEnqueueWriteBuffer(e->command_queue, e->roots_im, CL_TRUE, 0, sizeof(cl_double) * num_roots, roots_im, 0, NULL, NULL);
+    assert_cl_success(error, "write to cl roots buffer");
+
+    cl_uint degree = poly_degree;
+    cl_double step = fabs(X_MAX - X_MIN) / picture_size;
+    cl_uint size = picture_size;
+    assert_cl_success(clSetKernelArg(e->kernel, 0, sizeof(cl_mem), &e->roots_re), "set kernel arg 0");
+    assert_cl_success(clSetKernelArg(e->kernel, 1, sizeof(cl_mem), &e->roots_im), "set kernel arg 1");
+    assert_cl_success(clSetKernelArg(e->kernel, 2, sizeof(cl_uint), &degree), "set kernel arg 2");
+    assert_cl_success(clSetKernelArg(e->kernel, 3, sizeof(cl_double), &step), "set kernel arg 3");
+    assert_cl_success(clSetKernelArg(e->kernel, 4, sizeof(cl_uint), &size), "set kernel arg 4");
+
+    cl_event reads[2];
+    size_t num_blocks = (picture_size + CL_BLOCK_ROWS - 1) / CL_BLOCK_ROWS;
+    for (size_t b = 0; b <= num_blocks; b++) {
+        if (b < num_blocks) {
+            cl_uint first_row = b * CL_BLOCK_ROWS;
+            size_t global_size[2] = {picture_size, picture_size - first_row < CL_BLOCK_ROWS ? picture_size - first_row : CL_BLOCK_ROWS};
+            assert_cl_success(clSetKernelArg(e->kernel, 5, sizeof(cl_uint), &first_row), "set kernel arg 5");
+            assert_cl_success(clSetKernelArg(e->kernel, 6, sizeof(cl_mem), &e->blocks[b % 2]), "set kernel arg 6");
+            error = clEnqueueNDRangeKernel(e->command_queue, e->kernel, 2, NULL, global_size, NULL, 0, NULL, NULL);
+            assert_cl_success(error, "enqueue kernel");
+            error = clEnqueueReadBuffer(e->command_queue, e->blocks[b % 2], CL_FALSE, 0, sizeof(struct result) * picture_size * global_size[1],
+                                        results[first_row], 0, NULL, &reads[b % 2]);
+            assert_cl_success(error, "read from cl block buffer");
+            clFlush(e->command_queue);
+        }
+
+        if (b > 0) {
+            assert_cl_success(clWaitForEvents(1, &reads[(b - 1) % 2]), "wait for cl block");
+            clReleaseEvent(reads[(b - 1) % 2]);
+            pthread_mutex_lock(&ready_mutex);
+            for (size_t i = (b - 1) * CL_BLOCK_ROWS; i < picture_size && i < b * CL_BLOCK_ROWS; i++) {
+                ready[i] = true;
+            }
+            pthread_mutex_unlock(&ready_mutex);
+        }
+    }
+}
+
+void release_engine() {
+    struct engine* e = &engine;
+    if (!e->initialized) {
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (e->blocks[i] != NULL) {
+            clReleaseMemObject(e->blocks[i]);
+            e->blocks[i] = NULL;
+        }
+    }
+    e->block_capacity = 0;
+    clReleaseMemObject(e->roots_re);
+    clReleaseMemObject(e->roots_im);
+    clReleaseCommandQueue(e->command_queue);
+    clReleaseKernel(e->kernel);
+    clReleaseProgram(e->program);
+    close_opencl_device(&e->device);
+    e->initialized = 0;
+}
+#else
+// Built without OpenCL, jobs that ask for a device are turned down, so the rest are
+// never called.
+int valid_device_spec(const char* device_spec) {
+    return device_spec == NULL;
+}
+
+void read_program_source() {
+}
+
+void run_kernels() {
+}
+
+void release_engine() {
+}
+#endif
@@ -0,0 +1,104 @@
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+// Keep a * b + c as two roundings, as in newton.c, so that fewer pixels tip over to
+// another root or iteration count.
+#pragma OPENCL FP_CONTRACT OFF
+
+// OUT_OF_BOUNDS, ERROR_MARGIN_2, X_MIN and MAX_ITERATIONS are passed in by newton.c
+// as build options.
+
+// x = x * y
+void
+    multiply(
+        double* re,
+        double* im,
+        const double y_re,
+        const double y_im
+    )
+{
+    double x_re = *re;
+    *re = x_re * y_re - *im * y_im;
+    *im = x_re * y_im + *im * y_re;
+}
+
+// The step from x to 1 / (d x^(d - 1)) + (d - 1) x / d, as in next_x in newton.c. The
+// division is Smith's, which is close to what the complex division of the C
+// version does.
+void
+    next_x(
+        double* re,
+        double* im,
+        const uint degree
+    )
+{
+    if (degree == 1) {
+        *re = 1.0;
+        *im = 0.0;
+        return;
+    }
+
+    double p_re = degree * *re;
+    double p_im = degree * *im;
+    for (uint k = 2; k < degree; k++) {
+        multiply(&p_re, &p_im, *re, *im);
+    }
+
+    double q_re, q_im;
+    if (fabs(p_re) >= fabs(p_im)) {
+        double r = p_im / p_re;
+        double den = p_re + p_im * r;
+        q_re = 1.0 / den;
+        q_im = -r / den;
+    } else {
+        double r = p_re / p_im;
+        double den = p_re * r + p_im;
+        q_re = r / den;
+        q_im = -1.0 / den;
+    }
+
+    *re = q_re + (degree - 1) * *re / degree;
+    *im = q_im + (degree - 1) * *im / degree;
+}
+
+// Each work-item iterates one pixel of a block of rows, and writes its root, or -1,
+// and its iteration count, as a struct result in newton.c.
+__kernel void
+    newton(
+        __global const double* roots_re,
+        __global const double* roots_im,
+        const uint degree,
+        const double step,
+        const uint picture_size,
+        const uint first_row,
+        __global char* results
+    )
+{
+    size_t col = get_global_id(0);
+    size_t row = get_global_id(1);
+    double re = X_MIN + col * step;
+    double im = X_MIN + (first_row + row) * step;
+
+    int root = -1;
+    int i;
+    for (i = 0; ; i++) {
+        if (re * re + im * im < ERROR_MARGIN_2 || fabs(re) > OUT_OF_BOUNDS || fabs(im) > OUT_OF_BOUNDS) {
+            break;
+        }
+
+        for (uint k = 0; k < degree && root == -1; k++) {
+            double d_re = re - roots_re[k];
+            double d_im = im - roots_im[k];
+            if (d_re * d_re + d_im * d_im < ERROR_MARGIN_2) {
+                root = k;
+            }
+        }
+        if (root != -1) {
+            break;
+        }
+
+        next_x(&re, &im, degree);
+    }
+
+    __global char* result = results + 2 * (row * picture_size + col);
+    result[0] = root;
+    result[1] = i > MAX_ITERATIONS ? MAX_ITERATIONS : i;
+}
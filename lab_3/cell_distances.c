@@ -4,11 +4,30 @@
 #include <math.h>
 #include <getopt.h> 
 #include <omp.h> 
+#include <unistd.h>
+
+#include "compute_service.h"
+#include "placement.h"
+#ifdef USE_OPENCL
+#include "opencl_device.h"
+#endif
 
 #define MAX_LINES 100000
 #define LINE_LENGTH 24
 #define MAX_DIST 3466
 #define FILENAME "cells"
+#define PROGRAM_FILENAME "cell_distances.cl"
+#define CL_GROUP_SIZE 64
+#define CL_MAX_GROUPS ((MAX_LINES + CL_GROUP_SIZE - 1) / CL_GROUP_SIZE)
+
+// The micro-kernel compares MICRO_ROWS points of one chunk, kept in registers, with
+// vectors of points of the other, and counts the distances of MICRO_COLS points at a
+// time. Without cache sizes from the system, those of a typical x86 core are used.
+#define MICRO_ROWS 4
+#define MICRO_COLS 256
+#define DEFAULT_L1_SIZE (32 << 10)
+#define DEFAULT_L2_SIZE (256 << 10)
+#define TILES_PER_THREAD 4
 
 struct coord {
     short n1; 
@@ -16,39 +35,146 @@ struct coord {
     short n3;
 };
 
-void cell_distances(long dist_counts[], char* filename);
-size_t read_chunk(struct coord chunk[], FILE* fp);
+// The coordinates of a chunk, stored by axis so that consecutive points fill vectors.
+struct chunk {
+    int* n1;
+    int* n2;
+    int* n3;
+};
+
+// The pairs of two chunks are split into tiles of outer points of the first, which
+// stay in L2 while the second is swept in tiles of inner points, which stay in L1.
+struct tiling {
+    long outer;
+    long inner;
+};
+
+#ifdef USE_OPENCL
+// The OpenCL objects that are kept between the jobs of a served program, as in lab_4:
+// the built program, a buffer for each axis of each of the two chunks, and the
+// counts. A job that asks for another device gets a new engine.
+struct engine {
+    int initialized;
+    struct opencl_device device;
+    char* source;
+    cl_program program;
+    cl_kernel count_kernel;
+    cl_kernel merge_kernel;
+    cl_command_queue command_queue;
+    cl_mem chunks[2][3];
+    cl_mem group_counts;
+    cl_mem counts;
+};
+
+struct engine engine;
+#endif
+
+int cell_distances_job(int argc, char* argv[]);
+void warm_up();
+void cell_distances(long dist_counts[], char* filename, int huge_pages, const char* device_spec);
+void alloc_chunk(struct chunk* chunk, int huge_pages);
+void free_chunk(struct chunk* chunk);
+size_t read_chunk(struct chunk* chunk, char* buffer, FILE* fp);
 struct coord parse_coord(char* line);
 short parse_pos(char* str);
-void compute_distances_within_chunk(long dist_counts[], struct coord chunk[], size_t chunk_size);
-void compute_distances_between_chunks(long dist_counts[], struct coord chunk_1[], size_t chunck_1_size, struct coord chunk_2[], size_t chunk_2_size);
-short compute_distance(struct coord c1, struct coord c2);
+struct tiling choose_tiling(size_t chunk_size);
+long get_cache_size(int name, long fallback);
+void compute_distances_within_chunk(long dist_counts[], const struct chunk* chunk, size_t chunk_size, struct tiling tiling);
+void compute_distances_between_chunks(long dist_counts[], const struct chunk* chunk_1, size_t chunk_1_size, const struct chunk* chunk_2, size_t chunk_2_size, struct tiling tiling);
+void count_block(long dist_counts[], const struct chunk* rows, long i, const struct chunk* cols, long col_begin, long col_end);
+void count_row(long dist_counts[], const struct chunk* rows, long i, const struct chunk* cols, long col_begin, long col_end);
+int distance_index(int squared_distance);
 void print_results(long dist_counts[]);
+int valid_device_spec(const char* device_spec);
+void read_program_source();
+void start_device_counts(long dist_counts[], const char* device_spec);
+void write_chunk_to_device(int slot, const struct chunk* chunk, size_t chunk_size);
+void count_on_device(int rows_slot, size_t num_rows, int cols_slot, size_t num_cols);
+void finish_device_counts(long dist_counts[]);
+void release_engine();
 
 int main(int argc, char* argv[]) {
-    if (argc < 2 || argv[1][0] != '-' || argv[1][1] != 't') {
-        printf("Usage: ./cell_distances -t<num_threads>\n");
+    const char* path = compute_service_path(argc, argv);
+    if (path != NULL) {
+        return compute_serve(path, argv[0], cell_distances_job, warm_up);
+    }
+    int status = cell_distances_job(argc, argv);
+    release_engine();
+    return status;
+}
+
+int cell_distances_job(int argc, char* argv[]) {
+    int num_threads = 0;
+    char* placement_spec = NULL;
+    char* device_spec = NULL;
+    int huge_pages = 0;
+    struct placement placement;
+
+    int option;
+    while ((option = getopt(argc, argv, "t:a:HD:")) != -1) {
+        switch (option) {
+            case 't':
+                num_threads = atoi(optarg);
+                break;
+            case 'a':
+                placement_spec = optarg;
+                break;
+            case 'H':
+                huge_pages = 1;
+                break;
+            case 'D':
+                device_spec = optarg;
+                break;
+            default:
+                num_threads = 0;
+        }
+    }
+    // With -D, the pairs are counted on an OpenCL device, and the threads only read
+    // the chunks.
+    if (num_threads <= 0 || argc - optind > 1 || !valid_device_spec(device_spec)
+            || parse_placement(placement_spec, &placement) != 0) {
+        printf("Usage: ./cell_distances -t<num_threads> [-a<placement>] [-H] [-D<device>] [filename]\n");
         exit(1);
     }
 
     char* filename = FILENAME;
-    if (argc == 3) {
-        filename = argv[2];
+    if (optind < argc) {
+        filename = argv[optind];
     }
 
-    int num_threads = atoi(argv[1] + 2);
     omp_set_num_threads(num_threads);
+    pin_openmp_threads(&placement);
 
     long dist_counts[MAX_DIST];
-    cell_distances(dist_counts, filename);
+    cell_distances(dist_counts, filename, huge_pages, device_spec);
     print_results(dist_counts);
 
+    free_placement(&placement);
     return 0;
 }
 
-void cell_distances(long dist_counts[], char* filename) {
-    struct coord chunk_1[MAX_LINES];
-    struct coord chunk_2[MAX_LINES];
+// The OpenMP threads stay around between parallel regions, and so between served
+// jobs, once they have been started. Jobs run in the working directory of the
+// client, so the OpenCL program is read from where the server started, but only
+// built for a job that asks for a device.
+void warm_up() {
+    #pragma omp parallel
+    {
+    }
+    read_program_source();
+}
+
+// The chunks are on the heap rather than the stack of the main thread, so that their
+// pages are first touched by the threads that parse them.
+void cell_distances(long dist_counts[], char* filename, int huge_pages, const char* device_spec) {
+    struct chunk chunk_1, chunk_2;
+    alloc_chunk(&chunk_1, huge_pages);
+    alloc_chunk(&chunk_2, huge_pages);
+    char* buffer = (char*) malloc(MAX_LINES * LINE_LENGTH);
+    if (buffer == NULL) {
+        printf("could not allocate memory\n");
+        exit(1);
+    }
 
     FILE* fp = fopen(filename, "r");
     if (fp == NULL) {
@@ -59,15 +185,29 @@ void cell_distances(long dist_counts[], char* filename) {
     for (size_t i = 0; i < MAX_DIST; i++) {
         dist_counts[i] = 0;
     }
+    if (device_spec != NULL) {
+        start_device_counts(dist_counts, device_spec);
+    }
 
     size_t chunk_1_size;
     long i = 0;
-    while ((chunk_1_size = read_chunk(chunk_1, fp)) > 0) {
-        compute_distances_within_chunk(dist_counts, chunk_1, chunk_1_size);
+    while ((chunk_1_size = read_chunk(&chunk_1, buffer, fp)) > 0) {
+        struct tiling tiling = choose_tiling(chunk_1_size);
+        if (device_spec != NULL) {
+            write_chunk_to_device(0, &chunk_1, chunk_1_size);
+            count_on_device(0, chunk_1_size, 0, chunk_1_size);
+        } else {
+            compute_distances_within_chunk(dist_counts, &chunk_1, chunk_1_size, tiling);
+        }
         
         size_t chunk_2_size;
-        while ((chunk_2_size = read_chunk(chunk_2, fp)) > 0) {
-            compute_distances_between_chunks(dist_counts, chunk_1, chunk_1_size, chunk_2, chunk_2_size);
+        while ((chunk_2_size = read_chunk(&chunk_2, buffer, fp)) > 0) {
+            if (device_spec != NULL) {
+                write_chunk_to_device(1, &chunk_2, chunk_2_size);
+                count_on_device(0, chunk_1_size, 1, chunk_2_size);
+            } else {
+                compute_distances_between_chunks(dist_counts, &chunk_1, chunk_1_size, &chunk_2, chunk_2_size, tiling);
+            }
         }
 
         i++;
@@ -75,15 +215,36 @@ void cell_distances(long dist_counts[], char* filename) {
         fseek(fp, i * MAX_LINES * LINE_LENGTH, SEEK_SET);
     }
 
+    if (device_spec != NULL) {
+        finish_device_counts(dist_counts);
+    }
     fclose(fp);
+    free_chunk(&chunk_1);
+    free_chunk(&chunk_2);
+    free(buffer);
+}
+
+void alloc_chunk(struct chunk* chunk, int huge_pages) {
+    chunk->n1 = (int*) placement_alloc(sizeof(int) * MAX_LINES, huge_pages);
+    chunk->n2 = (int*) placement_alloc(sizeof(int) * MAX_LINES, huge_pages);
+    chunk->n3 = (int*) placement_alloc(sizeof(int) * MAX_LINES, huge_pages);
 }
 
-size_t read_chunk(struct coord chunk[], FILE* fp) {
-    char line[LINE_LENGTH];
-    long lines_read = 0;
-    while (lines_read < MAX_LINES && fread(line, sizeof(char), LINE_LENGTH, fp) == LINE_LENGTH) {
-        chunk[lines_read] = parse_coord(line);
-        lines_read++;
+void free_chunk(struct chunk* chunk) {
+    free(chunk->n1);
+    free(chunk->n2);
+    free(chunk->n3);
+}
+
+// Reads the lines of a chunk at once, and parses them in parallel.
+size_t read_chunk(struct chunk* chunk, char* buffer, FILE* fp) {
+    long lines_read = fread(buffer, LINE_LENGTH, MAX_LINES, fp);
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < lines_read; i++) {
+        struct coord c = parse_coord(buffer + i * LINE_LENGTH);
+        chunk->n1[i] = c.n1;
+        chunk->n2[i] = c.n2;
+        chunk->n3[i] = c.n3;
     }
     return lines_read;
 }
@@ -108,36 +269,134 @@ short parse_pos(char* str) {
     return n;
 }
 
-void compute_distances_within_chunk(long dist_counts[], struct coord chunk[], size_t chunk_size) {
-    #pragma omp parallel for reduction(+:dist_counts[:MAX_DIST])
-    for (size_t i = 0; i < chunk_size - 1; i++) {
-        for (size_t j = i + 1; j < chunk_size; j++) {
-            struct coord c1 = chunk[i];
-            struct coord c2 = chunk[j];
-            short dist = compute_distance(c1, c2);
-            dist_counts[dist]++;
+// Half of each cache is left for the other tile, the counts and the rest. There are
+// at least TILES_PER_THREAD outer tiles per thread, to balance the load.
+struct tiling choose_tiling(size_t chunk_size) {
+    long point_size = 3 * sizeof(int);
+    long l1_size = get_cache_size(_SC_LEVEL1_DCACHE_SIZE, DEFAULT_L1_SIZE);
+    long l2_size = get_cache_size(_SC_LEVEL2_CACHE_SIZE, DEFAULT_L2_SIZE);
+    long max_outer = (chunk_size / (TILES_PER_THREAD * omp_get_max_threads()) + MICRO_ROWS) / MICRO_ROWS * MICRO_ROWS;
+
+    struct tiling tiling;
+    tiling.inner = l1_size / 2 / point_size / MICRO_COLS * MICRO_COLS;
+    tiling.outer = l2_size / 2 / point_size / MICRO_ROWS * MICRO_ROWS;
+    if (tiling.inner < MICRO_COLS) {
+        tiling.inner = MICRO_COLS;
+    }
+    if (tiling.outer > max_outer) {
+        tiling.outer = max_outer;
+    }
+    return tiling;
+}
+
+long get_cache_size(int name, long fallback) {
+    long size = sysconf(name);
+    return size > 0 ? size : fallback;
+}
+
+// Pairs (i, j) with i < j. Groups of MICRO_ROWS rows go through the micro-kernel with
+// the columns past the group, and the pairs within a group, or with the rows left
+// over at the end of a tile, are counted a row at a time.
+void compute_distances_within_chunk(long dist_counts[], const struct chunk* chunk, size_t chunk_size, struct tiling tiling) {
+    long n = chunk_size;
+    #pragma omp parallel for schedule(dynamic) reduction(+:dist_counts[:MAX_DIST])
+    for (long tile = 0; tile < n; tile += tiling.outer) {
+        long tile_end = tile + tiling.outer < n ? tile + tiling.outer : n;
+        long groups_end = tile + (tile_end - tile) / MICRO_ROWS * MICRO_ROWS;
+        for (long col = tile; col < n; col += tiling.inner) {
+            long col_end = col + tiling.inner < n ? col + tiling.inner : n;
+            for (long i = tile; i < groups_end; i += MICRO_ROWS) {
+                long col_begin = col > i + MICRO_ROWS ? col : i + MICRO_ROWS;
+                if (col_begin < col_end) {
+                    count_block(dist_counts, chunk, i, chunk, col_begin, col_end);
+                }
+            }
+            for (long i = groups_end; i < tile_end; i++) {
+                long col_begin = col > i + 1 ? col : i + 1;
+                if (col_begin < col_end) {
+                    count_row(dist_counts, chunk, i, chunk, col_begin, col_end);
+                }
+            }
+        }
+        for (long group = tile; group < groups_end; group += MICRO_ROWS) {
+            for (long i = group; i < group + MICRO_ROWS; i++) {
+                count_row(dist_counts, chunk, i, chunk, i + 1, group + MICRO_ROWS);
+            }
         }
     }
 }
 
-void compute_distances_between_chunks(long dist_counts[], struct coord chunk_1[], size_t chunk_1_size, struct coord chunk_2[], size_t chunk_2_size) {
-    #pragma omp parallel for collapse(2) reduction(+:dist_counts[:MAX_DIST])
-    for (size_t i = 0; i < chunk_1_size; i++) {
-        for (size_t j = 0; j < chunk_2_size; j++) {
-            struct coord c1 = chunk_1[i];
-            struct coord c2 = chunk_2[j];
-            short dist = compute_distance(c1, c2);
-            dist_counts[dist]++;
+void compute_distances_between_chunks(long dist_counts[], const struct chunk* chunk_1, size_t chunk_1_size, const struct chunk* chunk_2, size_t chunk_2_size, struct tiling tiling) {
+    long n1 = chunk_1_size;
+    long n2 = chunk_2_size;
+    #pragma omp parallel for schedule(dynamic) reduction(+:dist_counts[:MAX_DIST])
+    for (long tile = 0; tile < n1; tile += tiling.outer) {
+        long tile_end = tile + tiling.outer < n1 ? tile + tiling.outer : n1;
+        long groups_end = tile + (tile_end - tile) / MICRO_ROWS * MICRO_ROWS;
+        for (long col = 0; col < n2; col += tiling.inner) {
+            long col_end = col + tiling.inner < n2 ? col + tiling.inner : n2;
+            for (long i = tile; i < groups_end; i += MICRO_ROWS) {
+                count_block(dist_counts, chunk_1, i, chunk_2, col, col_end);
+            }
+            for (long i = groups_end; i < tile_end; i++) {
+                count_row(dist_counts, chunk_1, i, chunk_2, col, col_end);
+            }
         }
     }
 }
 
-short compute_distance(struct coord c1, struct coord c2){
-    int d1 = c1.n1 - c2.n1;
-    int d2 = c1.n2 - c2.n2;
-    int d3 = c1.n3 - c2.n3;
-    double d = sqrt(d1 * d1 + d2 * d2 + d3 * d3);
-    return (short) (d / 10.0);
+// Counts the distances from rows i to i + MICRO_ROWS - 1 to columns col_begin to
+// col_end - 1. Each coordinate of a column is loaded once for all of the rows, and
+// the distances of MICRO_COLS columns are worked out in vectors before they are
+// counted, since the counting does not vectorize.
+void count_block(long dist_counts[], const struct chunk* rows, long i, const struct chunk* cols, long col_begin, long col_end) {
+    int r1[MICRO_ROWS], r2[MICRO_ROWS], r3[MICRO_ROWS];
+    for (int r = 0; r < MICRO_ROWS; r++) {
+        r1[r] = rows->n1[i + r];
+        r2[r] = rows->n2[i + r];
+        r3[r] = rows->n3[i + r];
+    }
+
+    int indices[MICRO_ROWS][MICRO_COLS];
+    for (long col = col_begin; col < col_end; col += MICRO_COLS) {
+        long num_cols = col + MICRO_COLS < col_end ? MICRO_COLS : col_end - col;
+        const int* restrict c1 = cols->n1 + col;
+        const int* restrict c2 = cols->n2 + col;
+        const int* restrict c3 = cols->n3 + col;
+        for (long j = 0; j < num_cols; j++) {
+            for (int r = 0; r < MICRO_ROWS; r++) {
+                int d1 = r1[r] - c1[j];
+                int d2 = r2[r] - c2[j];
+                int d3 = r3[r] - c3[j];
+                indices[r][j] = distance_index(d1 * d1 + d2 * d2 + d3 * d3);
+            }
+        }
+        for (int r = 0; r < MICRO_ROWS; r++) {
+            for (long j = 0; j < num_cols; j++) {
+                dist_counts[indices[r][j]]++;
+            }
+        }
+    }
+}
+
+void count_row(long dist_counts[], const struct chunk* rows, long i, const struct chunk* cols, long col_begin, long col_end) {
+    for (long j = col_begin; j < col_end; j++) {
+        int d1 = rows->n1[i] - cols->n1[j];
+        int d2 = rows->n2[i] - cols->n2[j];
+        int d3 = rows->n3[i] - cols->n3[j];
+        dist_counts[distance_index(d1 * d1 + d2 * d2 + d3 * d3)]++;
+    }
+}
+
+// The distance in hundredths, rounded down, as an index into the counts, which is the
+// largest k with 100 k^2 <= squared_distance. Single precision gets within one of it,
+// and the integer checks correct that, in vectors of twice as many lanes as a double
+// square root and division would take.
+int distance_index(int squared_distance) {
+    int k = (int) (sqrtf((float) squared_distance) * 0.1f);
+    k += 100 * (k + 1) * (k + 1) <= squared_distance;
+    k -= 100 * k * k > squared_distance;
+    return k;
 }
 
 void print_results(long dist_counts[]) {
@@ -148,3 +407,154 @@ void print_results(long dist_counts[]) {
         }
     }
 }
+
+#ifdef USE_OPENCL
+int valid_device_spec(const char* device_spec) {
+    return valid_opencl_device_spec(device_spec);
+}
+
+void read_program_source() {
+    if (engine.source == NULL && access(PROGRAM_FILENAME, R_OK) == 0) {
+        engine.source = read_opencl_source(PROGRAM_FILENAME);
+    }
+}
+
+void init_cl(struct engine* e, const char* device_spec) {
+    if (e->initialized && opencl_device_matches(&e->device, device_spec)) {
+        return;
+    }
+    release_engine();
+    cl_int error;
+
+    // Pick the device, and build the kernels, or load them from the binary cache.
+    open_opencl_device(device_spec, &e->device);
+    if (e->source == NULL) {
+        e->source = read_opencl_source(PROGRAM_FILENAME);
+    }
+    char options[64];
+    snprintf(options, sizeof(options), "-DMAX_DIST=%d", MAX_DIST);
+    e->program = build_opencl_program(&e->device, e->source, options);
+
+    e->count_kernel = clCreateKernel(e->program, "count_distances", &error);
+    assert_cl_success(error, "create kernel");
+    e->merge_kernel = clCreateKernel(e->program, "merge_counts", &error);
+    assert_cl_success(error, "create merge kernel");
+    e->command_queue = clCreateCommandQueueWithProperties(e->device.context, e->device.device_id, NULL, &error);
+    assert_cl_success(error, "create command queue");
+
+    for (int slot = 0; slot < 2; slot++) {
+        for (int axis = 0; axis < 3; axis++) {
+            e->chunks[slot][axis] = clCreateBuffer(e->device.context, CL_MEM_READ_ONLY, sizeof(cl_int) * MAX_LINES, NULL, &error);
+            assert_cl_success(error, "create cl chunk buffer");
+        }
+    }
+    e->group_counts = clCreateBuffer(e->device.context, CL_MEM_READ_WRITE, sizeof(cl_uint) * CL_MAX_GROUPS * MAX_DIST, NULL, &error);
+    assert_cl_success(error, "create cl group counts buffer");
+    e->counts = clCreateBuffer(e->device.context, CL_MEM_READ_WRITE, sizeof(cl_ulong) * MAX_DIST, NULL, &error);
+    assert_cl_success(error, "create cl counts buffer");
+    e->initialized = 1;
+}
+
+// The counts on the device start out as dist_counts, which is all zeros.
+void start_device_counts(long dist_counts[], const char* device_spec) {
+    init_cl(&engine, device_spec);
+    cl_int error = clEnqueueWriteBuffer(engine.command_queue, engine.counts, CL_TRUE, 0, sizeof(cl_ulong) * MAX_DIST, dist_counts, 0, NULL, NULL);
+    assert_cl_success(error, "write to cl counts buffer");
+}
+
+// The write blocks, since the next chunk is read into the same memory.
+void write_chunk_to_device(int slot, const struct chunk* chunk, size_t chunk_size) {
+    const int* axes[3] = {chunk->n1, chunk->n2, chunk->n3};
+    for (int axis = 0; axis < 3; axis++) {
+        cl_int error = clEnqueueWriteBuffer(engine.command_queue, engine.chunks[slot][axis], CL_TRUE, 0, sizeof(cl_int) * chunk_size, axes[axis], 0, NULL, NULL);
+        assert_cl_success(error, "write to cl chunk buffer");
+    }
+}
+
+// Counts the pairs of a row chunk and a column chunk, or the pairs within a chunk if
+// they are the same, and adds them to the counts on the device.
+void count_on_device(int rows_slot, size_t num_rows, int cols_slot, size_t num_cols) {
+    cl_uint rows = num_rows, cols = num_cols, triangle = rows_slot == cols_slot;
+    cl_uint num_groups = (num_rows + CL_GROUP_SIZE - 1) / CL_GROUP_SIZE;
+    cl_kernel kernel = engine.count_kernel;
+    for (int axis = 0; axis < 3; axis++) {
+        assert_cl_success(clSetKernelArg(kernel, axis, sizeof(cl_mem), &engine.chunks[rows_slot][axis]), "set kernel arg");
+        assert_cl_success(clSetKernelArg(kernel, 4 + axis, sizeof(cl_mem), &engine.chunks[cols_slot][axis]), "set kernel arg");
+    }
+    assert_cl_success(clSetKernelArg(kernel, 3, sizeof(cl_uint), &rows), "set kernel arg 3");
+    assert_cl_success(clSetKernelArg(kernel, 7, sizeof(cl_uint), &cols), "set kernel arg 7");
+    assert_cl_success(clSetKernelArg(kernel, 8, sizeof(cl_uint), &triangle), "set kernel arg 8");
+    assert_cl_success(clSetKernelArg(kernel, 9, sizeof(cl_mem), &engine.group_counts), "set kernel arg 9");
+    size_t global_size = num_groups * CL_GROUP_SIZE;
+    size_t local_size = CL_GROUP_SIZE;
+    cl_int error = clEnqueueNDRangeKernel(engine.command_queue, kernel, 1, NULL, &global_size, &local_size, 0, NULL, NULL);
+    assert_cl_success(error, "enqueue kernel");
+
+    kernel = engine.merge_kernel;
+    assert_cl_success(clSetKernelArg(kernel, 0, sizeof(cl_mem), &engine.group_counts), "set merge kernel arg 0");
+    assert_cl_success(clSetKernelArg(kernel, 1, sizeof(cl_uint), &num_groups), "set merge kernel arg 1");
+    assert_cl_success(clSetKernelArg(kernel, 2, sizeof(cl_mem), &engine.counts), "set merge kernel arg 2");
+    global_size = MAX_DIST;
+    error = clEnqueueNDRangeKernel(engine.command_queue, kernel, 1, NULL, &global_size, NULL, 0, NULL, NULL);
+    assert_cl_success(error, "enqueue merge kernel");
+}
+
+void finish_device_counts(long dist_counts[]) {
+    cl_int error = clEnqueueReadBuffer(engine.command_queue, engine.counts, CL_TRUE, 0, sizeof(cl_ulong) * MAX_DIST, dist_counts, 0, NULL, NULL);
+    assert_cl_success(error, "read from cl counts buffer");
+}
+
+void release_engine() {
+    struct engine* e = &engine;
+    if (!e->initialized) {
+        return;
+    }
+    for (int slot = 0; slot < 2; slot++) {
+        for (int axis = 0; axis < 3; axis++) {
+            clReleaseMemObject(e->chunks[slot][axis]);
+        }
+    }
+    clReleaseMemObject(e->group_counts);
+    clReleaseMemObject(e->counts);
+    clReleaseCommandQueue(e->command_queue);
+    clReleaseKernel(e->merge_kernel);
+    clReleaseKernel(e->count_kernel);
+    clReleaseProgram(e->program);
+    close_opencl_device(&e->device);
+    e->initialized = 0;
+}
+#else
+// Built without OpenCL, jobs that ask for a device are turned down, so the rest are
+// never called.
+int valid_device_spec(const char* device_spec) {
+    return device_spec == NULL;
+}
+
+void read_program_source() {
+}
+
+void start_device_counts(long dist_counts[], const char* device_spec) {
+    (void) dist_counts;
+    (void) device_spec;
+}
+
+void write_chunk_to_device(int slot, const struct chunk* chunk, size_t chunk_size) {
+    (void) slot;
+    (void) chunk;
+    (void) chunk_size;
+}
+
+void count_on_device(int rows_slot, size_t num_rows, int cols_slot, size_t num_cols) {
+    (void) rows_slot;
+    (void) num_rows;
+    (void) cols_slot;
+    (void) num_cols;
+}
+
+void finish_device_counts(long dist_counts[]) {
+    (void) dist_counts;
+}
+
+void release_engine() {
+}
+#endif
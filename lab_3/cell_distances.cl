@@ -0,0 +1,80 @@
+// MAX_DIST is passed in by cell_distances.c as a build option.
+
+// The distance in hundredths, rounded down, as in distance_index in cell_distances.c.
+// The square root may be off by a few ulp here, which the integer checks correct.
+int
+    distance_index(
+        const int squared_distance
+    )
+{
+    int k = (int) (sqrt((float) squared_distance) * 0.1f);
+    k += 100 * (k + 1) * (k + 1) <= squared_distance;
+    k -= 100 * k * k > squared_distance;
+    return k;
+}
+
+// Each work-item counts the distances from one row point to the column points, or
+// to those past it if the rows and columns are the same chunk, in the histogram of
+// its work-group in local memory. A work-group counts fewer than 2^32 pairs, so the
+// histograms are written out as they are, for merge_counts to add up.
+__kernel void
+    count_distances(
+        __global const int* rows_n1,
+        __global const int* rows_n2,
+        __global const int* rows_n3,
+        const uint num_rows,
+        __global const int* cols_n1,
+        __global const int* cols_n2,
+        __global const int* cols_n3,
+        const uint num_cols,
+        const uint triangle,
+        __global uint* group_counts
+    )
+{
+    __local uint counts[MAX_DIST];
+
+    for (size_t i = get_local_id(0); i < MAX_DIST; i += get_local_size(0)) {
+        counts[i] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    size_t row = get_global_id(0);
+    if (row < num_rows) {
+        int n1 = rows_n1[row];
+        int n2 = rows_n2[row];
+        int n3 = rows_n3[row];
+        for (size_t col = triangle ? row + 1 : 0; col < num_cols; col++) {
+            int d1 = n1 - cols_n1[col];
+            int d2 = n2 - cols_n2[col];
+            int d3 = n3 - cols_n3[col];
+            atomic_inc(&counts[distance_index(d1 * d1 + d2 * d2 + d3 * d3)]);
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    __global uint* out = group_counts + get_group_id(0) * MAX_DIST;
+    for (size_t i = get_local_id(0); i < MAX_DIST; i += get_local_size(0)) {
+        out[i] = counts[i];
+    }
+}
+
+// Adds the histograms of num_groups work-groups to counts, one distance per
+// work-item.
+__kernel void
+    merge_counts(
+        __global const uint* group_counts,
+        const uint num_groups,
+        __global ulong* counts
+    )
+{
+    size_t i = get_global_id(0);
+    if (i >= MAX_DIST) {
+        return;
+    }
+
+    ulong sum = 0;
+    for (uint g = 0; g < num_groups; g++) {
+        sum += group_counts[g * MAX_DIST + i];
+    }
+    counts[i] += sum;
+}
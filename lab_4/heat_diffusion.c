@@ -2,26 +2,140 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <time.h>
 #include <CL/cl.h>
 
-void read_input_file(char* filename, size_t* rows, size_t* cols, float** matrix);
-void init_cl(cl_context* context, cl_command_queue* command_queue, cl_program* program, cl_kernel* kernel);
-char* read_program();
-double average(float* matrix, size_t n);
-double average_diff(float* matrix, double avg, size_t n);
+#include "diffusion_input.h"
+#include "diffusion_checkpoint.h"
+#include "diffusion_reduce.h"
+#include "compute_service.h"
+#include "placement.h"
+#include "opencl_device.h"
+
+struct region {
+    size_t row_begin;
+    size_t row_end;
+    size_t col_begin;
+    size_t col_end;
+};
+
+// Device events are read and released in batches of this size, so that long runs
+// do not keep one event per kernel alive.
+#define PROFILE_BATCH 1024
+
+// Either a host-side phase timed with the host clock, or a command on the device
+// timed by its profiling info. Device times are on the device clock.
+struct profile_record {
+    const char* source;
+    const char* name;
+    long iteration;
+    cl_ulong queued;
+    cl_ulong submit;
+    cl_ulong start;
+    cl_ulong end;
+};
+
+struct profile {
+    int enabled;
+    cl_ulong host_start;
+    struct profile_record* records;
+    size_t num_records;
+    size_t capacity;
+    cl_event pending[PROFILE_BATCH];
+    size_t pending_records[PROFILE_BATCH];
+    size_t num_pending;
+};
+
+struct checkpoint_writer {
+    pthread_t thread;
+    int running;
+    cl_event read_event;
+    float* grid;
+    struct diffusion_checkpoint_header header;
+};
+
+// The OpenCL objects that are kept between the jobs of a served program: the built
+// program, a command queue for each setting of profiling, and buffers that are only
+// reallocated when a job needs larger ones. A job that asks for another device gets
+// a new engine, built from the source read by the first one.
+struct engine {
+    int initialized;
+    struct opencl_device device;
+    char* source;
+    cl_program program;
+    cl_kernel kernel;
+    cl_kernel delta_kernel;
+    cl_command_queue command_queues[2];
+    cl_mem matrix_buffers[2];
+    size_t matrix_capacities[2];
+    cl_mem deltas_buffer;
+    size_t deltas_capacity;
+};
+
+int heat_diffusion_job(int argc, char* argv[]);
+void warm_up_engine();
+void read_input_file(char* filename, size_t* rows, size_t* cols, float** matrix, struct region* active);
+void read_restart_file(char* filename, size_t* rows, size_t* cols, float** matrix, struct region* active, long* start_iteration, float* diffusion_constant);
+void start_checkpoint(struct checkpoint_writer* writer, cl_command_queue command_queue, cl_mem matrix_buffer, size_t rows, size_t cols, long iteration, float diffusion_constant);
+void* checkpoint_writer_main(void* arg);
+void finish_checkpoint(struct checkpoint_writer* writer);
+void grow_region(struct region* r, size_t rows, size_t cols);
+void init_cl(struct engine* e, const char* device_spec);
+cl_command_queue get_command_queue(struct engine* e, int profiling);
+cl_mem reserve_buffer(struct engine* e, cl_mem* buffer, size_t* capacity, size_t size, cl_mem_flags flags, char* msg);
+void release_engine(struct engine* e);
+cl_ulong host_time_ns();
+struct profile_record* add_profile_record(struct profile* p, const char* source, const char* name, long iteration);
+void profile_host(struct profile* p, const char* name, cl_ulong start);
+cl_event* profile_device(struct profile* p, const char* name, long iteration);
+void flush_profile(struct profile* p);
+void write_profile(struct profile* p, char* filename);
+size_t round_up(size_t x, size_t multiple);
 void assert_success(cl_int error, char* msg);
 
 #define FILENAME "diffusion"
+#define PROFILE_FILENAME "profile.csv"
+#define CONVERGENCE_CHECK_INTERVAL 100
+// Must match DELTA_GROUP_WIDTH in heat_diffusion.cl.
+#define DELTA_GROUP_WIDTH 16
+
+struct engine engine;
 
 int main(int argc, char* argv[]) {
+    const char* path = compute_service_path(argc, argv);
+    if (path != NULL) {
+        return compute_serve(path, argv[0], heat_diffusion_job, warm_up_engine);
+    }
+    int status = heat_diffusion_job(argc, argv);
+    release_engine(&engine);
+    free(engine.source);
+    return status;
+}
+
+// heat_diffusion.cl is read relative to the working directory, which for jobs is the
+// client's, so a served program is built up front from where the server started.
+void warm_up_engine() {
+    init_cl(&engine, NULL);
+}
+
+int heat_diffusion_job(int argc, char* argv[]) {
     // Parse cmd args.
     float diffusion_constant = -1;
     long iterations = -1;
+    float tolerance = -1;
+    long checkpoint_interval = -1;
+    char* restart_filename = NULL;
+    char* placement_spec = NULL;
+    char* device_spec = NULL;
+    struct profile profile = {0};
+    profile.host_start = host_time_ns();
 
     int option; 
-    while ((option = getopt(argc, argv, "n:d:")) != -1) {
+    while ((option = getopt(argc, argv, "n:d:t:c:r:pa:D:")) != -1) {
         switch (option) {
             case 'n':
                 iterations = atoi(optarg);
@@ -29,190 +143,484 @@ int main(int argc, char* argv[]) {
             case 'd':
                 diffusion_constant = atof(optarg);
                 break;
+            case 't':
+                tolerance = atof(optarg);
+                break;
+            case 'c':
+                checkpoint_interval = atoi(optarg);
+                break;
+            case 'r':
+                restart_filename = optarg;
+                break;
+            case 'p':
+                profile.enabled = 1;
+                break;
+            case 'a':
+                placement_spec = optarg;
+                break;
+            case 'D':
+                device_spec = optarg;
+                break;
             default:
-                printf("Usage: ./heat_diffusion -n<number of iterations> -d<diffusion constant>\n");
+                printf("Usage: ./heat_diffusion -n<number of iterations> -d<diffusion constant> [-t<tolerance>] [-c<checkpoint interval, written to diffusion_<iteration>.checkpoint>] [-r<checkpoint>] [-p] [-a<placement>] [-D<device>] <filename>\n");
                 return 1;
         }
     }
 
     char* filename = FILENAME;
-    if (argc == 4) {
-        filename = argv[3];
+    if (optind < argc) {
+        filename = argv[optind];
     }
 
-    if (iterations  == -1 || diffusion_constant == -1){ 
-        printf("Usage: ./heat_diffusion -n<number of iterations> -d<diffusion constant> <filename>\n");
+    // When restarting, the diffusion constant defaults to the one in the checkpoint.
+    // The placement is that of the threads that reduce the result on the host.
+    struct placement placement;
+    if (iterations  == -1 || (diffusion_constant == -1 && restart_filename == NULL) || !valid_opencl_device_spec(device_spec)
+            || parse_placement(placement_spec, &placement) != 0){ 
+        printf("Usage: ./heat_diffusion -n<number of iterations> -d<diffusion constant> [-t<tolerance>] [-c<checkpoint interval, written to diffusion_<iteration>.checkpoint>] [-r<checkpoint>] [-p] [-a<placement>] [-D<device>] <filename>\n");
         return 1;
     }
 
-    // Read input file.
+    pin_openmp_threads(&placement);
+
+    // Read input file, or the grid of the checkpoint to restart from.
+    cl_ulong phase_start = host_time_ns();
     size_t rows, cols;
     float* matrix;
-    read_input_file(filename, &rows, &cols, &matrix);
+    struct region active;
+    long start_iteration = 0;
+    if (restart_filename != NULL) {
+        read_restart_file(restart_filename, &rows, &cols, &matrix, &active, &start_iteration, &diffusion_constant);
+    } else {
+        read_input_file(filename, &rows, &cols, &matrix, &active);
+    }
     size_t n = rows * cols;
+    profile_host(&profile, "parse", phase_start);
 
-    // Init OpenCL.
-    cl_context context;
-    cl_command_queue command_queue; 
-    cl_program program;
-    cl_kernel kernel;
-    init_cl(&context, &command_queue, &program, &kernel);
+    // Init OpenCL, unless it is still warm from an earlier job.
+    phase_start = host_time_ns();
+    init_cl(&engine, device_spec);
+    cl_command_queue command_queue = get_command_queue(&engine, profile.enabled);
+    cl_kernel kernel = engine.kernel, delta_kernel = engine.delta_kernel;
+    profile_host(&profile, "build", phase_start);
 
     // Create and init buffer.
+    phase_start = host_time_ns();
     cl_int error;
-    cl_mem matrix_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(float) * n, NULL, &error);
-    assert_success(error, "create cl buffer");
-    error = clEnqueueWriteBuffer(command_queue, matrix_buffer, CL_TRUE, 0, sizeof(float) * n, matrix, 0, NULL, NULL);
-    assert_success(error, "write to cl buffer");
+    // The iterations go back and forth between two buffers. Both start out as the
+    // input, since the cells outside of the active region are never written.
+    cl_mem matrix_buffers[2];
+    for (int b = 0; b < 2; b++) {
+        matrix_buffers[b] = reserve_buffer(&engine, &engine.matrix_buffers[b], &engine.matrix_capacities[b], sizeof(float) * n, CL_MEM_READ_WRITE, "create cl buffer");
+        error = clEnqueueWriteBuffer(command_queue, matrix_buffers[b], CL_TRUE, 0, sizeof(float) * n, matrix, 0, NULL, profile_device(&profile, "write_buffer", -1));
+        assert_success(error, "write to cl buffer");
+    }
+    cl_mem matrix_buffer = matrix_buffers[0];
+    cl_mem next_matrix_buffer = matrix_buffers[1];
+    profile_host(&profile, "transfer_in", phase_start);
+
+    // One maximum change per work-group when checking for convergence.
+    size_t max_groups = round_up(cols, DELTA_GROUP_WIDTH) / DELTA_GROUP_WIDTH * round_up(rows, DELTA_GROUP_WIDTH) / DELTA_GROUP_WIDTH;
+    float* deltas = NULL;
+    cl_mem deltas_buffer = NULL;
+    if (tolerance >= 0) {
+        deltas = (float*) malloc(sizeof(float) * max_groups);
+        deltas_buffer = reserve_buffer(&engine, &engine.deltas_buffer, &engine.deltas_capacity, sizeof(float) * max_groups, CL_MEM_WRITE_ONLY, "create cl deltas buffer");
+    }
 
     // Execute kernel.
-    assert_success(clSetKernelArg(kernel, 0, sizeof(cl_mem), &matrix_buffer), "set kernel arg 0");
-    assert_success(clSetKernelArg(kernel, 1, sizeof(cl_uint), &n), "set kernel arg 1");
-    assert_success(clSetKernelArg(kernel, 2, sizeof(cl_uint), &cols), "set kernel arg 2");
-    assert_success(clSetKernelArg(kernel, 3, sizeof(cl_float), &diffusion_constant), "set kernel arg 3");
-    for (size_t i = 0; i < iterations; i++) {
-        const size_t global = n;
-        error = clEnqueueNDRangeKernel(command_queue, kernel, 1, NULL, (const size_t*) &global, NULL, 0, NULL, NULL);
-        assert_success(error, "enqueue kernel");
-    }
-
-    // Read output.
-    error = clEnqueueReadBuffer(command_queue, matrix_buffer, CL_TRUE, 0, n * sizeof(float), matrix, 0, NULL, NULL);
-    assert_success(error, "read from cl buffer");
+    assert_success(clSetKernelArg(kernel, 2, sizeof(cl_uint), &n), "set kernel arg 2");
+    assert_success(clSetKernelArg(kernel, 3, sizeof(cl_uint), &cols), "set kernel arg 3");
+    assert_success(clSetKernelArg(kernel, 4, sizeof(cl_float), &diffusion_constant), "set kernel arg 4");
+    assert_success(clSetKernelArg(delta_kernel, 2, sizeof(cl_uint), &n), "set delta kernel arg 2");
+    assert_success(clSetKernelArg(delta_kernel, 3, sizeof(cl_uint), &cols), "set delta kernel arg 3");
+    assert_success(clSetKernelArg(delta_kernel, 4, sizeof(cl_float), &diffusion_constant), "set delta kernel arg 4");
+    assert_success(clSetKernelArg(delta_kernel, 7, sizeof(cl_mem), &deltas_buffer), "set delta kernel arg 7");
+    phase_start = host_time_ns();
+    struct checkpoint_writer checkpoint_writer = {0};
+    long iterations_done = 0;
+    while (iterations_done < iterations) {
+        // Only diffuse the bounding box of cells that can be non-zero by now.
+        grow_region(&active, rows, cols);
+        if (active.row_begin >= active.row_end) {
+            iterations_done = iterations;
+            break;
+        }
+        iterations_done++;
+        const size_t offset[2] = {active.col_begin, active.row_begin};
+        const size_t global[2] = {active.col_end - active.col_begin, active.row_end - active.row_begin};
+
+        // A checkpoint read is enqueued after this iteration's kernel, so it sees its
+        // result, whether or not the iteration also checks for convergence.
+        int checkpoint = checkpoint_interval > 0 && (start_iteration + iterations_done) % checkpoint_interval == 0;
+
+        if (tolerance < 0 || iterations_done % CONVERGENCE_CHECK_INTERVAL != 0) {
+            assert_success(clSetKernelArg(kernel, 0, sizeof(cl_mem), &matrix_buffer), "set kernel arg 0");
+            assert_success(clSetKernelArg(kernel, 1, sizeof(cl_mem), &next_matrix_buffer), "set kernel arg 1");
+            error = clEnqueueNDRangeKernel(command_queue, kernel, 2, offset, global, NULL, 0, NULL, profile_device(&profile, "heat_diffusion", iterations_done));
+            assert_success(error, "enqueue kernel");
+            cl_mem previous = matrix_buffer;
+            matrix_buffer = next_matrix_buffer;
+            next_matrix_buffer = previous;
+            if (checkpoint) {
+                start_checkpoint(&checkpoint_writer, command_queue, matrix_buffer, rows, cols, start_iteration + iterations_done, diffusion_constant);
+            }
+            continue;
+        }
+
+        // Fuse this iteration with a reduction of the largest change in any cell.
+        const cl_uint col_end = active.col_end, row_end = active.row_end;
+        const size_t local[2] = {DELTA_GROUP_WIDTH, DELTA_GROUP_WIDTH};
+        const size_t rounded_global[2] = {round_up(global[0], DELTA_GROUP_WIDTH), round_up(global[1], DELTA_GROUP_WIDTH)};
+        size_t groups = rounded_global[0] / DELTA_GROUP_WIDTH * rounded_global[1] / DELTA_GROUP_WIDTH;
+        assert_success(clSetKernelArg(delta_kernel, 0, sizeof(cl_mem), &matrix_buffer), "set delta kernel arg 0");
+        assert_success(clSetKernelArg(delta_kernel, 1, sizeof(cl_mem), &next_matrix_buffer), "set delta kernel arg 1");
+        assert_success(clSetKernelArg(delta_kernel, 5, sizeof(cl_uint), &col_end), "set delta kernel arg 5");
+        assert_success(clSetKernelArg(delta_kernel, 6, sizeof(cl_uint), &row_end), "set delta kernel arg 6");
+        error = clEnqueueNDRangeKernel(command_queue, delta_kernel, 2, offset, rounded_global, local, 0, NULL, profile_device(&profile, "heat_diffusion_delta", iterations_done));
+        assert_success(error, "enqueue delta kernel");
+        cl_mem previous = matrix_buffer;
+        matrix_buffer = next_matrix_buffer;
+        next_matrix_buffer = previous;
+        if (checkpoint) {
+            start_checkpoint(&checkpoint_writer, command_queue, matrix_buffer, rows, cols, start_iteration + iterations_done, diffusion_constant);
+        }
+        error = clEnqueueReadBuffer(command_queue, deltas_buffer, CL_TRUE, 0, groups * sizeof(float), deltas, 0, NULL, profile_device(&profile, "read_deltas", iterations_done));
+        assert_success(error, "read from cl deltas buffer");
+
+        float max_delta = 0;
+        for (size_t g = 0; g < groups; g++) {
+            max_delta = deltas[g] > max_delta ? deltas[g] : max_delta;
+        }
+        if (max_delta < tolerance) {
+            break;
+        }
+    }
 
     // Wait for computation to finish.
     error = clFinish(command_queue);
     assert_success(error, "finish");
+    profile_host(&profile, "compute", phase_start);
+
+    // Read output, and wait for any checkpoint still being written.
+    phase_start = host_time_ns();
+    error = clEnqueueReadBuffer(command_queue, matrix_buffer, CL_TRUE, 0, n * sizeof(float), matrix, 0, NULL, profile_device(&profile, "read_buffer", -1));
+    assert_success(error, "read from cl buffer");
+    finish_checkpoint(&checkpoint_writer);
+    profile_host(&profile, "transfer_out", phase_start);
 
     // Calculate & print averages.
-    double avg = average(matrix, n); 
-    double avg_diff = average_diff(matrix, avg, n);
+    phase_start = host_time_ns();
+    double avg, avg_diff;
+    struct diffusion_block whole = {0, rows, 0, cols};
+    diffusion_reduce_statistics(matrix, cols, &whole, &avg, &avg_diff);
+    profile_host(&profile, "reduce", phase_start);
     printf("average: %lf\naverage absolute difference: %lf\n", avg, avg_diff);
+    if (tolerance >= 0) {
+        printf("iterations: %ld\n", iterations_done);
+    }
+    if (profile.enabled) {
+        write_profile(&profile, PROFILE_FILENAME);
+    }
 
-    // Release resources.
+    // Release resources, except for those kept in the engine.
     free(matrix);
-    clReleaseCommandQueue(command_queue);
-    clReleaseContext(context);
-    clReleaseProgram(program);
-    clReleaseKernel(kernel);
-    clReleaseMemObject(matrix_buffer);
+    free(deltas);
+    free(checkpoint_writer.grid);
+    free_placement(&placement);
+    return 0;
 }
 
-void init_cl(cl_context* context, cl_command_queue* command_queue, cl_program* program, cl_kernel* kernel) {
+void init_cl(struct engine* e, const char* device_spec) {
+    if (e->initialized && opencl_device_matches(&e->device, device_spec)) {
+        return;
+    }
+    release_engine(e);
     cl_int error;
 
-    // Create platform.
-    cl_platform_id platform_id;
-    cl_uint nmb_platforms;
-    error = clGetPlatformIDs(1, &platform_id, &nmb_platforms);
-    assert_success(error, "get platform id");
-
-    // Create device.
-    cl_device_id device_id;
-    cl_uint nmb_devices;
-    error = clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_GPU, 1, &device_id, &nmb_devices);
-    assert_success(error, "get device id");
-
-    // Create context.
-    cl_context_properties properties[] = {
-        CL_CONTEXT_PLATFORM,
-        (cl_context_properties) platform_id,
+    // Pick the device, and build the kernels, or load them from the binary cache.
+    open_opencl_device(device_spec, &e->device);
+    if (e->source == NULL) {
+        e->source = read_opencl_source("heat_diffusion.cl");
+    }
+    cl_program* program = &e->program;
+    *program = build_opencl_program(&e->device, e->source, NULL);
+
+    e->kernel = clCreateKernel(*program, "heat_diffusion", &error);
+    assert_success(error, "create kernel");
+
+    e->delta_kernel = clCreateKernel(*program, "heat_diffusion_delta", &error);
+    assert_success(error, "create delta kernel");
+    e->initialized = 1;
+}
+
+cl_command_queue get_command_queue(struct engine* e, int profiling) {
+    if (e->command_queues[profiling] != NULL) {
+        return e->command_queues[profiling];
+    }
+
+    cl_int error;
+    cl_queue_properties queue_properties[] = {
+        CL_QUEUE_PROPERTIES,
+        profiling ? CL_QUEUE_PROFILING_ENABLE : 0,
         0
     };
-    *context = clCreateContext(properties, 1, &device_id, NULL, NULL, &error);
-    assert_success(error, "create context");
-
-    // Create command queue.
-    *command_queue = clCreateCommandQueueWithProperties(*context, device_id, 0, &error);
+    e->command_queues[profiling] = clCreateCommandQueueWithProperties(e->device.context, e->device.device_id, queue_properties, &error);
     assert_success(error, "create command queue");
-    
-    // Build kernel.
-    char* opencl_program_src = read_program();
-    *program = clCreateProgramWithSource(*context, 1, (const char **) &opencl_program_src, NULL, &error);
-    free(opencl_program_src);
-    assert_success(error, "create program");
-
-    error = clBuildProgram(*program, 0, NULL, NULL, NULL, NULL);
-    if (error != CL_SUCCESS) {
-        printf("cannot build program. log:\n");
+    return e->command_queues[profiling];
+}
+
+// Returns a buffer of at least size bytes, reusing the one from an earlier job if it
+// is large enough. The kernels take the size of the grid as an argument, so a larger
+// buffer does no harm.
+cl_mem reserve_buffer(struct engine* e, cl_mem* buffer, size_t* capacity, size_t size, cl_mem_flags flags, char* msg) {
+    if (*buffer != NULL && *capacity >= size) {
+        return *buffer;
+    }
+    if (*buffer != NULL) {
+        clReleaseMemObject(*buffer);
+    }
+
+    cl_int error;
+    *buffer = clCreateBuffer(e->device.context, flags, size, NULL, &error);
+    assert_success(error, msg);
+    *capacity = size;
+    return *buffer;
+}
 
-        size_t log_size = 0;
-        error = clGetProgramBuildInfo(*program, device_id, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-        assert_success(error, "get program build info");
+void release_engine(struct engine* e) {
+    if (!e->initialized) {
+        return;
+    }
+    if (e->deltas_buffer != NULL) {
+        clReleaseMemObject(e->deltas_buffer);
+    }
+    for (int b = 0; b < 2; b++) {
+        if (e->matrix_buffers[b] != NULL) {
+            clReleaseMemObject(e->matrix_buffers[b]);
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (e->command_queues[i] != NULL) {
+            clReleaseCommandQueue(e->command_queues[i]);
+        }
+    }
+    clReleaseKernel(e->delta_kernel);
+    clReleaseKernel(e->kernel);
+    clReleaseProgram(e->program);
+    close_opencl_device(&e->device);
+    memset(e->command_queues, 0, sizeof(e->command_queues));
+    memset(e->matrix_buffers, 0, sizeof(e->matrix_buffers));
+    memset(e->matrix_capacities, 0, sizeof(e->matrix_capacities));
+    e->deltas_buffer = NULL;
+    e->deltas_capacity = 0;
+    e->initialized = 0;
+}
+
+void read_input_file(char* filename, size_t* rows, size_t* cols, float** matrix, struct region* active) {
+    struct diffusion_input input;
+    read_diffusion_input(filename, 0, &input);
+
+    *rows = input.rows;
+    *cols = input.cols;
+    *matrix = input.matrix;
+    active->row_begin = input.row_begin;
+    active->row_end = input.row_end;
+    active->col_begin = input.col_begin;
+    active->col_end = input.col_end;
+}
 
-        char* log = calloc(log_size, sizeof(char));
-        if (log == NULL) {
+void read_restart_file(char* filename, size_t* rows, size_t* cols, float** matrix, struct region* active, long* start_iteration, float* diffusion_constant) {
+    struct diffusion_input input;
+    struct diffusion_checkpoint_header header;
+    read_diffusion_checkpoint(filename, 0, &input, &header);
+
+    *rows = input.rows;
+    *cols = input.cols;
+    *matrix = input.matrix;
+    active->row_begin = input.row_begin;
+    active->row_end = input.row_end;
+    active->col_begin = input.col_begin;
+    active->col_end = input.col_end;
+    *start_iteration = header.iterations;
+    if (*diffusion_constant == -1) {
+        *diffusion_constant = header.diffusion_constant;
+    }
+}
+
+cl_ulong host_time_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (cl_ulong) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct profile_record* add_profile_record(struct profile* p, const char* source, const char* name, long iteration) {
+    if (p->num_records == p->capacity) {
+        p->capacity = p->capacity == 0 ? PROFILE_BATCH : 2 * p->capacity;
+        p->records = (struct profile_record*) realloc(p->records, sizeof(struct profile_record) * p->capacity);
+        if (p->records == NULL) {
             printf("could not allocate memory\n");
             exit(1);
         }
+    }
+
+    struct profile_record* record = p->records + p->num_records++;
+    record->source = source;
+    record->name = name;
+    record->iteration = iteration;
+    return record;
+}
 
-        error = clGetProgramBuildInfo(*program, device_id, CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
-        assert_success(error, "get program build info");
-        printf( "%s\n", log );
+// Records a host-side phase that started at start and ends now.
+void profile_host(struct profile* p, const char* name, cl_ulong start) {
+    if (!p->enabled) {
+        return;
+    }
 
-        free(log);
+    struct profile_record* record = add_profile_record(p, "host", name, -1);
+    record->queued = record->submit = record->start = start - p->host_start;
+    record->end = host_time_ns() - p->host_start;
+}
 
-        exit(1);
+// Returns the event to pass to the next enqueue call, or NULL if profiling is off.
+cl_event* profile_device(struct profile* p, const char* name, long iteration) {
+    if (!p->enabled) {
+        return NULL;
+    }
+    if (p->num_pending == PROFILE_BATCH) {
+        flush_profile(p);
     }
 
-    *kernel = clCreateKernel(*program, "heat_diffusion", &error);
-    assert_success(error, "create kernel");
+    add_profile_record(p, "device", name, iteration);
+    p->pending_records[p->num_pending] = p->num_records - 1;
+    return &p->pending[p->num_pending++];
+}
+
+// Waits for all pending events and copies their timestamps into their records.
+void flush_profile(struct profile* p) {
+    if (p->num_pending == 0) {
+        return;
+    }
+
+    assert_success(clWaitForEvents(p->num_pending, p->pending), "wait for profiled events");
+    for (size_t i = 0; i < p->num_pending; i++) {
+        struct profile_record* record = p->records + p->pending_records[i];
+        cl_event event = p->pending[i];
+        assert_success(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &record->queued, NULL), "get queued time");
+        assert_success(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &record->submit, NULL), "get submit time");
+        assert_success(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &record->start, NULL), "get start time");
+        assert_success(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &record->end, NULL), "get end time");
+        clReleaseEvent(event);
+    }
+    p->num_pending = 0;
 }
 
-char* read_program() {
-    FILE *f = fopen("heat_diffusion.cl", "r");
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
+// Writes one line per record in nanoseconds. Host times are relative to the start
+// of the program and device times to the first command queued on the device.
+void write_profile(struct profile* p, char* filename) {
+    flush_profile(p);
+
+    cl_ulong device_start = 0;
+    int any_device = 0;
+    for (size_t i = 0; i < p->num_records; i++) {
+        struct profile_record* record = p->records + i;
+        if (record->source[0] == 'd' && (!any_device || record->queued < device_start)) {
+            device_start = record->queued;
+            any_device = 1;
+        }
+    }
 
-    char* string = malloc(fsize + 1);
-    fread(string, 1, fsize, f);
+    FILE* f = fopen(filename, "w");
+    if (f == NULL) {
+        printf("could not open file %s\n", filename);
+        exit(1);
+    }
+    fprintf(f, "source,name,iteration,queued_ns,submit_ns,start_ns,end_ns,duration_ns\n");
+    for (size_t i = 0; i < p->num_records; i++) {
+        struct profile_record* record = p->records + i;
+        cl_ulong offset = record->source[0] == 'd' ? device_start : 0;
+        fprintf(f, "%s,%s,", record->source, record->name);
+        if (record->iteration >= 0) {
+            fprintf(f, "%ld", record->iteration);
+        }
+        fprintf(f, ",%lu,%lu,%lu,%lu,%lu\n",
+            (unsigned long) (record->queued - offset), (unsigned long) (record->submit - offset),
+            (unsigned long) (record->start - offset), (unsigned long) (record->end - offset),
+            (unsigned long) (record->end - record->start));
+    }
     fclose(f);
 
-    string[fsize] = 0;
-
-    return string;
+    free(p->records);
 }
 
-void read_input_file(char* filename, size_t* rows, size_t* cols, float** matrix) {
-    FILE* f = fopen(filename, "r");
-    char* line;
-    int read = fscanf(f, "%zu %zu\n", cols, rows);
-    if (read < 2) {
-        printf("error read input file\n");
+// Copies the grid to the host without blocking and hands it to a thread that writes
+// it to disk once the copy is done, so that the kernels keep running meanwhile.
+void start_checkpoint(struct checkpoint_writer* writer, cl_command_queue command_queue, cl_mem matrix_buffer, size_t rows, size_t cols, long iteration, float diffusion_constant) {
+    finish_checkpoint(writer);
+
+    if (writer->grid == NULL) {
+        writer->grid = (float*) malloc(sizeof(float) * rows * cols);
+        if (writer->grid == NULL) {
+            printf("could not allocate memory\n");
+            exit(1);
+        }
     }
+    init_diffusion_checkpoint_header(&writer->header, rows, cols, iteration, diffusion_constant);
+
+    cl_int error = clEnqueueReadBuffer(command_queue, matrix_buffer, CL_FALSE, 0, sizeof(float) * rows * cols, writer->grid, 0, NULL, &writer->read_event);
+    assert_success(error, "read checkpoint from cl buffer");
+    assert_success(clFlush(command_queue), "flush");
 
-    size_t n = (*rows) * (*cols);
-    float* m = (float*) malloc(sizeof(float) * n);
-    for (size_t i = 0; i < n; i++) {
-        m[i] = 0;
+    int ret;
+    if ((ret = pthread_create(&writer->thread, NULL, checkpoint_writer_main, writer))) {
+        printf("Error creating checkpoint writer thread: %d\n", ret);
+        exit(1);
     }
+    writer->running = 1;
+}
+
+void* checkpoint_writer_main(void* arg) {
+    struct checkpoint_writer* writer = (struct checkpoint_writer*) arg;
 
-    size_t row, col;
-    float val;
-    while ((read = fscanf(f, "%zu %zu %f\n", &col, &row, &val)) == 3) {
-        m[row * (*cols) + col] = val;
+    assert_success(clWaitForEvents(1, &writer->read_event), "wait for checkpoint read");
+    clReleaseEvent(writer->read_event);
+    char filename[DIFFUSION_CHECKPOINT_FILENAME_LEN];
+    diffusion_checkpoint_filename(filename, writer->header.iterations);
+    write_diffusion_checkpoint(filename, &writer->header, writer->grid);
+
+    return NULL;
+}
+
+// Waits for the checkpoint being written, if any. The grid buffer is kept for reuse
+// until the writer is finished for the last time.
+void finish_checkpoint(struct checkpoint_writer* writer) {
+    if (!writer->running) {
+        return;
     }
 
-    *matrix = m;
+    int ret;
+    if ((ret = pthread_join(writer->thread, NULL))) {
+        printf("Error joining checkpoint writer thread: %d\n", ret);
+        exit(1);
+    }
+    writer->running = 0;
 }
 
-double average(float* matrix, size_t n) {
-  double avg = 0;
-  for (size_t i = 1; i <= n; i++) {
-    double x = matrix[i-1];
-    avg += (x - avg) / i;
-  }
-  return avg;
+// Each iteration only reads the grid of the one before, so heat spreads at most one
+// cell per iteration, and after growing the region by one cell in every direction
+// everything outside of it is guaranteed to still be zero.
+void grow_region(struct region* r, size_t rows, size_t cols) {
+    if (r->row_begin >= r->row_end || r->col_begin >= r->col_end) {
+        return;
+    }
+    r->row_begin = r->row_begin > 0 ? r->row_begin - 1 : 0;
+    r->row_end = r->row_end < rows ? r->row_end + 1 : rows;
+    r->col_begin = r->col_begin > 0 ? r->col_begin - 1 : 0;
+    r->col_end = r->col_end < cols ? r->col_end + 1 : cols;
 }
 
-double average_diff(float* matrix, double avg, size_t n) {
-  double avg_diff = 0;
-  for (size_t i = 1; i <= n; i++) {
-    double x = fabs(matrix[i-1] - avg);
-    avg_diff += (x - avg_diff) / i;
-  }
-  return avg_diff;
+size_t round_up(size_t x, size_t multiple) {
+    return (x + multiple - 1) / multiple * multiple;
 }
 
 void assert_success(cl_int error, char* msg) {
@@ -1,20 +1,22 @@
-__kernel void
-    heat_diffusion(
-        __global float* m,
+// Must match DELTA_GROUP_WIDTH in heat_diffusion.c.
+#define DELTA_GROUP_WIDTH 16
+
+float
+    new_temperature(
+        __global const float* m,
+        const size_t i,
         const uint n,
         const uint row_len,
         const float c
     )
 {
-    size_t i = get_global_id(0);
-    
     float sum = 0;
 
     // left
     if (i % row_len != 0) {
         sum += m[i-1];
     }
-    
+
     // right
     if (i % row_len != row_len - 1) {
         sum += m[i+1];
@@ -29,6 +31,70 @@ __kernel void
     if (i + row_len < n) {
         sum += m[i+row_len];
     }
-    
-    m[i] = m[i] + c * (sum / 4 - m[i]);
+
+    return m[i] + c * (sum / 4 - m[i]);
+}
+
+// Reads the grid of the previous iteration from src and writes the next one to dst,
+// so that every cell is updated from its neighbours' old temperatures, whatever the
+// order the work-items run in.
+__kernel void
+    heat_diffusion(
+        __global const float* src,
+        __global float* dst,
+        const uint n,
+        const uint row_len,
+        const float c
+    )
+{
+    // The host only enqueues the part of the grid that can be non-zero, so the
+    // index is built from the 2D global id rather than assumed to cover the grid.
+    size_t i = get_global_id(1) * row_len + get_global_id(0);
+
+    dst[i] = new_temperature(src, i, n, row_len, c);
+}
+
+// Same as heat_diffusion, but also writes the largest absolute change within each
+// work-group to deltas, measured between src and dst, so that it does not depend on
+// the order the work-items run in either. The global size is rounded up to whole
+// work-groups, so work-items outside of [0, col_end) x [0, row_end) only take part in
+// the reduction.
+__kernel void
+    heat_diffusion_delta(
+        __global const float* src,
+        __global float* dst,
+        const uint n,
+        const uint row_len,
+        const float c,
+        const uint col_end,
+        const uint row_end,
+        __global float* deltas
+    )
+{
+    __local float group_deltas[DELTA_GROUP_WIDTH * DELTA_GROUP_WIDTH];
+
+    size_t col = get_global_id(0);
+    size_t row = get_global_id(1);
+    size_t local_id = get_local_id(1) * DELTA_GROUP_WIDTH + get_local_id(0);
+
+    float delta = 0;
+    if (col < col_end && row < row_end) {
+        size_t i = row * row_len + col;
+        float new_value = new_temperature(src, i, n, row_len, c);
+        delta = fabs(new_value - src[i]);
+        dst[i] = new_value;
+    }
+    group_deltas[local_id] = delta;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (size_t stride = DELTA_GROUP_WIDTH * DELTA_GROUP_WIDTH / 2; stride > 0; stride /= 2) {
+        if (local_id < stride) {
+            group_deltas[local_id] = fmax(group_deltas[local_id], group_deltas[local_id + stride]);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (local_id == 0) {
+        deltas[get_group_id(1) * get_num_groups(0) + get_group_id(0)] = group_deltas[0];
+    }
 }
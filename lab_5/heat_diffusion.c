@@ -3,32 +3,207 @@
 #include <math.h>
 #include <getopt.h>
 #include <string.h>
+#include <limits.h>
+#include <signal.h>
 #include <mpi.h>
+#include <omp.h>
 
+#include "diffusion_input.h"
+#include "diffusion_checkpoint.h"
+#include "diffusion_stencil.h"
+#include "diffusion_reduce.h"
+#include "compute_service.h"
+#include "placement.h"
+
+struct region {
+    long row_begin;
+    long row_end;
+    long col_begin;
+    long col_end;
+};
+
+#define NUM_NEIGHBORS 8
+
+// Persistent requests exchanging the border of depth cells of a block with the
+// ghost cells of its up to eight neighbors, for each of the two matrices the
+// iterations alternate between. The diagonal neighbors fill in the corners, which
+// are only read when the ghost cells are updated redundantly. Index 0 is the receive
+// and index 1 the send.
+//
+// Both matrices live in a window of memory shared with the ranks on the same node.
+// Neighbors on the same node only send empty messages saying that their border is
+// ready, and the ghost cells are then read straight out of their matrices. Another
+// empty message back says that the border has been read and may be overwritten.
+struct halo_exchange {
+    int neighbors[NUM_NEIGHBORS];
+    MPI_Datatype types[NUM_NEIGHBORS][2];
+    MPI_Request requests[2][NUM_NEIGHBORS][2];
+    int pending_buffer;
+    int pending[NUM_NEIGHBORS];
+
+    MPI_Win window;
+    float* shared[2][NUM_NEIGHBORS];
+    struct region ghost_parts[NUM_NEIGHBORS];
+    struct region shared_parts[NUM_NEIGHBORS];
+    long shared_row_lens[NUM_NEIGHBORS];
+    MPI_Request done[NUM_NEIGHBORS][2];
+    int pending_done[NUM_NEIGHBORS];
+    long local_row_len;
+    float* buffers[2];
+};
+
+struct checkpoint {
+    int open;
+    MPI_Comm comm;
+    MPI_File file;
+    MPI_Request request;
+    float* cells;
+    char filename[DIFFUSION_CHECKPOINT_FILENAME_LEN];
+};
+
+// Neighbor d is in the direction of neighbor_offsets[d], and in the opposite
+// direction from it is neighbor NUM_NEIGHBORS - 1 - d.
+static const int neighbor_offsets[NUM_NEIGHBORS][2] = {
+    {-1, -1}, {-1, 0}, {-1, 1}, {0, -1}, {0, 1}, {1, -1}, {1, 0}, {1, 1}
+};
+
+int heat_diffusion_job(int argc, char* argv[]);
+int serve_jobs(const char* path, char* program);
 void main_master(int nmb_mpi_proc, char* filename, long iterations, float diffusion_constant);
 void main_worker(int nmb_mpi_proc, int mpi_rank, long iterations, float diffusion_constant);
-void read_dimensions(FILE* f, long* rows, long* cols);
-void read_matrix_values(FILE* f, float matrix[], long cols);
 long get_matrix_index(long row, long col, long row_len);
-void apply_heat_diffusion(float* result, float* local_matrix, long num_rows, long row_len, float diffusion_constant);
-float calculate_new_temperature(float* matrix, long i, long row_len, float diffusion_constant);
+void grow_region(struct region* r, long num_rows, long row_len);
+struct region intersect_regions(struct region r, struct region bounds);
+struct region shift_region(struct region r, long rows, long cols);
+struct region expand_region(struct region r, long cells);
+int region_is_empty(struct region r);
+struct region get_block(MPI_Comm grid, int grid_rank, long num_rows, long row_len);
+struct region find_active_region(MPI_Comm grid, struct diffusion_input* input, struct region block);
+int choose_process_grid(int nmb_mpi_proc, long num_rows, long row_len, int dims[2]);
+long choose_halo_depth(MPI_Comm grid, long border_len, long max_depth);
+void apply_heat_diffusion(float* result, float* local_matrix, struct region active, long row_len, float diffusion_constant, float* max_change);
+struct region get_halo_part(struct region block, long depth, int d, int ghost);
+long get_local_matrix_len(struct region block, long depth);
+long get_local_base(struct region block, long depth);
+void init_halo_exchange(struct halo_exchange* halos, float* buffers[2], float* initial, MPI_Comm grid, struct region block, long num_rows, long row_len, long depth, int huge_pages);
+void start_halo_exchange(struct halo_exchange* halos, int buffer, struct region active, struct region block, long depth);
+void wait_halo_exchange(struct halo_exchange* halos);
+void finish_halo_reads(struct halo_exchange* halos);
+void free_halo_exchange(struct halo_exchange* halos);
+MPI_Datatype create_block_type(struct region r, long row_len);
+void start_checkpoint(struct checkpoint* cp, MPI_Comm comm, float* local_matrix, struct region block, long local_row_len, long num_rows, long row_len, long iteration, float diffusion_constant);
+void finish_checkpoint(struct checkpoint* cp);
 void assert_success(int error, char* msg);
 void print_matrix(int rank, float* matrix, long matrix_len, long row_len);
-float average(float* matrix, long rows, long cols);
-float average_diff(float* matrix, float avg, long rows, long cols);
+void compute_statistics(MPI_Comm grid, float* local_matrix, struct region local_block, long local_row_len, long num_cells, float* avg, float* avg_diff);
 void swap(float** m1, float** m2);
 
 #define MASTER_RANK 0
 #define FILENAME "diffusion"
-#define ROW_TAG 1
+#define HALO_TAG 1
+#define DONE_TAG (HALO_TAG + NUM_NEIGHBORS)
+#define PROBE_TAG (DONE_TAG + NUM_NEIGHBORS)
+#define WAVEFRONT_MAX_STEPS 8
+#define CONVERGENCE_CHECK_INTERVAL 100
+#define PROBE_ROUNDS 100
 
 int main(int argc, char* argv[]) {
+    // Init MPI. Each rank updates its block with OpenMP threads, so one rank per node
+    // or socket is enough, but only the main thread makes MPI calls.
+    int error, thread_support;
+    error = MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_support);
+    assert_success(error, "mpi init");
+    if (thread_support < MPI_THREAD_FUNNELED) {
+        omp_set_num_threads(1);
+    }
+
+    const char* path = compute_service_path(argc, argv);
+    int status = path != NULL ? serve_jobs(path, argv[0]) : heat_diffusion_job(argc, argv);
+
+    // Release resources.
+    error = MPI_Finalize();
+    assert_success(error, "finalize");
+    return status;
+}
+
+// Rank 0 accepts the jobs and passes them on to the other ranks, which all run them
+// together, so that MPI and the OpenMP threads only start once. There is no worker
+// process to start over, so a job that exits takes the service with it.
+int serve_jobs(const char* path, char* program) {
+    int error, mpi_rank;
+    error = MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+    assert_success(error, "mpi comm rank");
+
+    int listener = -1;
+    if (mpi_rank == MASTER_RANK) {
+        listener = compute_listen(path);
+        if (listener != -1) {
+            printf("serving %s on %s\n", program, path);
+            fflush(stdout);
+        }
+    }
+    int listening = mpi_rank != MASTER_RANK || listener != -1;
+    error = MPI_Bcast(&listening, 1, MPI_INT, MASTER_RANK, MPI_COMM_WORLD);
+    assert_success(error, "broadcast listening");
+    if (!listening) {
+        return 1;
+    }
+    // A client that goes away in the middle of a job must not take the ranks with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    while (1) {
+        struct compute_job job;
+        uint32_t length = 0;
+        if (mpi_rank == MASTER_RANK && compute_accept(listener, program, &job) == 0) {
+            length = job.length;
+        }
+        error = MPI_Bcast(&length, 1, MPI_UINT32_T, MASTER_RANK, MPI_COMM_WORLD);
+        assert_success(error, "broadcast job length");
+        if (length == 0) {
+            return 1;
+        }
+
+        int failed = 0;
+        if (mpi_rank == MASTER_RANK) {
+            error = MPI_Bcast(job.strings, length, MPI_CHAR, MASTER_RANK, MPI_COMM_WORLD);
+        } else {
+            char* strings = (char*) malloc(length);
+            if (strings == NULL) {
+                printf("could not allocate memory\n");
+                exit(1);
+            }
+            error = MPI_Bcast(strings, length, MPI_CHAR, MASTER_RANK, MPI_COMM_WORLD);
+            failed = compute_unpack_job(strings, length, program, &job) != 0;
+        }
+        assert_success(error, "broadcast job");
+
+        // Every rank must be in the working directory of the job to run it.
+        error = MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+        assert_success(error, "reduce job setup");
+        int status = failed ? 1 : heat_diffusion_job(job.argc, job.argv);
+
+        if (mpi_rank == MASTER_RANK) {
+            compute_finish(&job, status);
+        } else {
+            compute_free_job(&job);
+        }
+    }
+}
+
+int heat_diffusion_job(int argc, char* argv[]) {
     // Parse cmd args.
     float diffusion_constant = -1;
     long iterations = -1;
+    float tolerance = -1;
+    long checkpoint_interval = -1;
+    char* restart_filename = NULL;
+    long halo_depth = 1;
+    int wavefront = 0;
+    char* placement_spec = NULL;
+    int huge_pages = 0;
 
     int option; 
-    while ((option = getopt(argc, argv, "n:d:")) != -1) {
+    while ((option = getopt(argc, argv, "n:d:t:c:r:g:wa:H")) != -1) {
         switch (option) {
             case 'n':
                 iterations = atoi(optarg);
@@ -36,186 +211,782 @@ int main(int argc, char* argv[]) {
             case 'd':
                 diffusion_constant = atof(optarg);
                 break;
+            case 't':
+                tolerance = atof(optarg);
+                break;
+            case 'c':
+                checkpoint_interval = atoi(optarg);
+                break;
+            case 'r':
+                restart_filename = optarg;
+                break;
+            case 'g':
+                halo_depth = atoi(optarg);
+                break;
+            case 'w':
+                wavefront = 1;
+                break;
+            case 'a':
+                placement_spec = optarg;
+                break;
+            case 'H':
+                huge_pages = 1;
+                break;
             default:
-                printf("Usage: ./heat_diffusion -n<number of iterations> -d<diffusion constant> <filename>\n");
+                printf("Usage: ./heat_diffusion -n<number of iterations> -d<diffusion constant> [-t<tolerance>] [-c<checkpoint interval, written to diffusion_<iteration>.checkpoint>] [-r<checkpoint>] [-g<halo depth>] [-w, needs -g0 or -g3 and up] [-a<placement>] [-H] <filename>\n");
                 return 1;
         }
     }
 
     char* filename = FILENAME;
-    if (argc == 4) {
-        filename = argv[3];
+    if (optind < argc) {
+        filename = argv[optind];
     }
 
-    if (iterations  == -1 || diffusion_constant == -1){ 
-        printf("Usage: ./heat_diffusion -n<number of iterations> -d<diffusion constant> <filename>\n");
+    // When restarting, the diffusion constant defaults to the one in the checkpoint.
+    // The threads of each rank are placed on the CPUs the rank is bound to. A
+    // wavefront fuses the iterations between two exchanges but the last, so it
+    // needs a halo depth of at least 3 to fuse any.
+    struct placement placement;
+    if (iterations  == -1 || (diffusion_constant == -1 && restart_filename == NULL) || halo_depth < 0
+            || (wavefront && halo_depth > 0 && halo_depth < 3)
+            || parse_placement(placement_spec, &placement) != 0){ 
+        printf("Usage: ./heat_diffusion -n<number of iterations> -d<diffusion constant> [-t<tolerance>] [-c<checkpoint interval, written to diffusion_<iteration>.checkpoint>] [-r<checkpoint>] [-g<halo depth>] [-w, needs -g0 or -g3 and up] [-a<placement>] [-H] <filename>\n");
         return 1;
     }
 
-    // Init MPI.
-    int error;
-    error = MPI_Init(&argc, &argv);
-    assert_success(error, "mpi init");
-
-    int nmb_mpi_proc, mpi_rank;
+    int error, nmb_mpi_proc, mpi_rank;
     error = MPI_Comm_size(MPI_COMM_WORLD, &nmb_mpi_proc);
     assert_success(error, "mpi comm size");
     error = MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
     assert_success(error, "mpi comm rank");
+    pin_openmp_threads(&placement);
 
-    float* matrix;
-    long num_rows, row_len, matrix_len;
+    long num_rows, row_len;
+    struct checkpoint checkpoint = {0};
+    long start_iteration = 0;
+    long iterations_done = 0;
+    float avg = 0, avg_diff = 0;
 
-    if (mpi_rank == MASTER_RANK) {
-        FILE* f = fopen(filename, "r");
+    // Every rank reads the dimensions, and later its own block, from the input file
+    // or from the checkpoint to restart from, so no rank ever holds the whole matrix.
+    struct diffusion_checkpoint_header header;
+    if (restart_filename != NULL) {
+        read_diffusion_checkpoint_header(restart_filename, &header);
+        num_rows = header.rows;
+        row_len = header.cols;
+        start_iteration = header.iterations;
+        if (diffusion_constant == -1) {
+            diffusion_constant = header.diffusion_constant;
+        }
+    } else {
+        read_diffusion_dimensions(filename, &num_rows, &row_len);
+    }
 
-        // Read dimensions from input file.
-        read_dimensions(f, &num_rows, &row_len);
+    // Split the grid into blocks of balanced size, one for each rank in a 2D grid of
+    // ranks. Ranks that do not fit in it, if the matrix has fewer rows or columns
+    // than there are ranks, sit the computation out. Ranks keep their numbers in
+    // the grid, so the master is rank 0 of it as well.
+    int dims[2];
+    int periods[2] = {0, 0};
+    choose_process_grid(nmb_mpi_proc, num_rows, row_len, dims);
+    MPI_Comm grid;
+    error = MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 0, &grid);
+    assert_success(error, "create process grid");
 
-        // Read matrix values from input file.
-        matrix_len = (num_rows+2) * (row_len+2);
-        matrix = (float*) malloc(sizeof(float) * matrix_len);
-        for (long i = 0; i < matrix_len; i++) {
-            matrix[i] = 0;
+    if (grid != MPI_COMM_NULL) {
+        int grid_rank;
+        error = MPI_Comm_rank(grid, &grid_rank);
+        assert_success(error, "grid rank");
+        struct region block = get_block(grid, grid_rank, num_rows, row_len);
+        long local_rows = block.row_end - block.row_begin;
+        long local_cols = block.col_end - block.col_begin;
+
+        // Each rank stores its block with depth ghost cells on every side, which are
+        // exchanged every depth iterations. In between, the ghost cells that are
+        // still needed are updated redundantly by the neighbors. A depth of 0 picks
+        // one from the message latency and the time to update the border. The
+        // smallest blocks are num_rows / dims[0] by row_len / dims[1] cells.
+        long max_depth = num_rows / dims[0] < row_len / dims[1] ? num_rows / dims[0] : row_len / dims[1];
+        if (halo_depth == 0) {
+            halo_depth = choose_halo_depth(grid, local_rows + local_cols, max_depth);
+            if (wavefront && halo_depth < 3) {
+                halo_depth = 3;
+            }
+        }
+        long depth = halo_depth < max_depth ? halo_depth : max_depth;
+        if (wavefront && depth < 3 && mpi_rank == MASTER_RANK) {
+            printf("warning: the blocks are too small for a halo depth of 3, -w has no effect\n");
         }
-        read_matrix_values(f, matrix, row_len);
-    } 
 
-    if (nmb_mpi_proc == 1) {
-        // If only one node, do everything locally.
-        float* matrix_copy = (float*) malloc(sizeof(float) * matrix_len);
-        for (long iter = 0; iter < iterations; iter++) {
-            apply_heat_diffusion(matrix_copy, matrix, num_rows, row_len, diffusion_constant);
-            swap(&matrix_copy, &matrix);
+        // The matrices are passed on offset by depth - 1 rows and columns, so that
+        // local cell (r, c) is at get_matrix_index(r, c, local_row_len) for -depth <= r, c.
+        long local_row_len = local_cols + 2 * depth - 2;
+
+        // Read the block, padded with the ghost cells, and find the active region of
+        // the whole matrix from the non-zero values of all blocks.
+        struct diffusion_block input_block = {block.row_begin, block.row_end, block.col_begin, block.col_end};
+        struct diffusion_input input;
+        if (restart_filename != NULL) {
+            read_diffusion_checkpoint_block(restart_filename, depth, &input_block, &input, &header);
+        } else {
+            read_diffusion_input_block(filename, depth, &input_block, &input);
         }
-        free(matrix_copy);
-    } else {
-        // Otherwise, distribute dimensions.
-        {
-            int len = 3;
-            long msg[len];
-            if (mpi_rank == MASTER_RANK) {
-                msg[0] = num_rows;
-                msg[1] = row_len;
-                msg[2] = matrix_len;
+        struct region active = find_active_region(grid, &input, block);
+
+        // Fill in the ghost cells of the first iteration.
+        float* buffers[2];
+        int current = 0;
+        struct halo_exchange halos;
+        init_halo_exchange(&halos, buffers, input.matrix, grid, block, num_rows, row_len, depth, huge_pages);
+        free(input.matrix);
+        struct region everything = {0, num_rows, 0, row_len};
+        start_halo_exchange(&halos, current, everything, block, depth);
+
+        // Begin computations.
+        struct region local_block = shift_region(block, -block.row_begin, -block.col_begin);
+        while (iterations_done < iterations) {
+            // With -w, the iterations up to the last one before the next exchange run
+            // in a single sweep over the block, unless they check for convergence or
+            // write a checkpoint. The sweep runs on one thread, so this is meant for
+            // one rank per core.
+            if (wavefront) {
+                struct diffusion_block regions[WAVEFRONT_MAX_STEPS];
+                struct region fused_active = active;
+                int steps = 0;
+                while (steps < WAVEFRONT_MAX_STEPS && iterations_done + steps < iterations) {
+                    long i = iterations_done + steps + 1;
+                    long extra = depth - 1 - (i - 1) % depth;
+                    if (extra == 0 || (tolerance >= 0 && i % CONVERGENCE_CHECK_INTERVAL == 0)
+                            || (checkpoint_interval > 0 && (start_iteration + i) % checkpoint_interval == 0)) {
+                        break;
+                    }
+                    grow_region(&fused_active, num_rows, row_len);
+                    struct region r = intersect_regions(fused_active, expand_region(block, extra));
+                    r = shift_region(r, -block.row_begin, -block.col_begin);
+                    regions[steps++] = (struct diffusion_block) {r.row_begin, r.row_end, r.col_begin, r.col_end};
+                }
+
+                // The sweep writes both matrices, so the neighbors must be done
+                // reading the border of the ghost cells received here as well.
+                if (steps > 1) {
+                    if (iterations_done % depth == 0) {
+                        wait_halo_exchange(&halos);
+                    }
+                    finish_halo_reads(&halos);
+                    long base = get_matrix_index(0, 0, local_row_len);
+                    float* sweep[2] = {buffers[current] + base, buffers[1 - current] + base};
+                    diffusion_stencil_wavefront(sweep, local_row_len + 2, regions, steps, diffusion_constant);
+                    active = fused_active;
+                    iterations_done += steps;
+                    current = (current + steps) % 2;
+                    continue;
+                }
             }
-            error = MPI_Bcast(msg, len, MPI_LONG, MASTER_RANK, MPI_COMM_WORLD);
-            assert_success(error, "broadcast dimensions");
-            if (mpi_rank != MASTER_RANK) {
-                num_rows = msg[0];
-                row_len = msg[1];
-                matrix_len = msg[2];
+
+            iterations_done++;
+            int check_convergence = tolerance >= 0 && iterations_done % CONVERGENCE_CHECK_INTERVAL == 0;
+            float changes[5] = {0};
+            float* src = buffers[current];
+            float* dst = buffers[1 - current];
+
+            // The ghost cells are valid to depth - step cells after step iterations
+            // since the last exchange, so this iteration can update extra cells
+            // beyond the block.
+            long step = (iterations_done - 1) % depth;
+            long extra = depth - 1 - step;
+
+            // Every rank tracks the same global active region, so neighbors agree on
+            // which ghost cells can still be zero without communicating.
+            grow_region(&active, num_rows, row_len);
+            struct region local_active = intersect_regions(active, expand_region(block, extra));
+            local_active = shift_region(local_active, -block.row_begin, -block.col_begin);
+
+            // The neighbors must be done reading the border of dst from the last
+            // exchange before it is overwritten.
+            finish_halo_reads(&halos);
+            if (step == 0) {
+                wait_halo_exchange(&halos);
             }
-        }
 
-        // Distribute matrix.
-        long rows_per_worker = num_rows / nmb_mpi_proc;
-        long padded_row_len = row_len + 2;
-        int local_matrix_len = (rows_per_worker + 2) * padded_row_len;
-        float* local_matrix = (float*) malloc(sizeof(float) * local_matrix_len);
-        int lens[nmb_mpi_proc], poss[nmb_mpi_proc];
-        if (mpi_rank == MASTER_RANK) {
-            for (long rank = 0; rank < nmb_mpi_proc; rank++) {
-                lens[rank] = local_matrix_len;
-                long row_offset = rows_per_worker * rank;
-                poss[rank] = row_offset * padded_row_len;
+            if (extra > 0) {
+                apply_heat_diffusion(dst, src, local_active, local_row_len, diffusion_constant, check_convergence ? &changes[0] : NULL);
+            } else {
+                // Last iteration before the next exchange: update the border the
+                // neighbors need first, and the interior while it is in flight.
+                struct region interior = expand_region(local_block, -depth);
+                struct region border[4] = {
+                    {0, depth, 0, local_cols},
+                    {interior.row_end > depth ? interior.row_end : depth, local_rows, 0, local_cols},
+                    {depth, local_rows - depth, 0, depth},
+                    {depth, local_rows - depth, interior.col_end > depth ? interior.col_end : depth, local_cols},
+                };
+                for (int i = 0; i < 4; i++) {
+                    apply_heat_diffusion(dst, src, intersect_regions(local_active, border[i]), local_row_len, diffusion_constant, check_convergence ? &changes[i] : NULL);
+                }
+                start_halo_exchange(&halos, 1 - current, active, block, depth);
+                apply_heat_diffusion(dst, src, intersect_regions(local_active, interior), local_row_len, diffusion_constant, check_convergence ? &changes[4] : NULL);
             }
-        }
-        error = MPI_Scatterv(matrix, lens, poss, MPI_FLOAT, local_matrix, local_matrix_len, MPI_FLOAT, MASTER_RANK, MPI_COMM_WORLD);
-        assert_success(error, "scatter matrix");
+            current = 1 - current;
 
-        // Begin computations.
-        float* local_matrix_copy = (float*) malloc(sizeof(float) * local_matrix_len);
-        for (long i = 0; i < local_matrix_len; i++) {
-            local_matrix_copy[i] = 0;
-        }
-        for (long iter = 0; iter < iterations; iter++) {
-            apply_heat_diffusion(local_matrix_copy, local_matrix, rows_per_worker, row_len, diffusion_constant);
-            swap(&local_matrix_copy, &local_matrix);
-
-            if (mpi_rank != 0) {
-                // Send up and receive from above.
-                error = MPI_Sendrecv(
-                    local_matrix + padded_row_len, padded_row_len, MPI_FLOAT, mpi_rank - 1, ROW_TAG,
-                    local_matrix, padded_row_len, MPI_FLOAT, mpi_rank - 1, ROW_TAG,
-                    MPI_COMM_WORLD, NULL);
-                assert_success(error, "send and recive from and to above");
+            if (checkpoint_interval > 0 && (start_iteration + iterations_done) % checkpoint_interval == 0) {
+                start_checkpoint(&checkpoint, grid, buffers[current], block, local_row_len,
+                    num_rows, row_len, start_iteration + iterations_done, diffusion_constant);
             }
-            if (mpi_rank != nmb_mpi_proc - 1) {
-                // Send down and receive from below.
-                error = MPI_Sendrecv(
-                    local_matrix + local_matrix_len - 2*padded_row_len, padded_row_len, MPI_FLOAT, mpi_rank + 1, ROW_TAG,
-                    local_matrix + local_matrix_len - padded_row_len, padded_row_len, MPI_FLOAT, mpi_rank + 1, ROW_TAG,
-                    MPI_COMM_WORLD, NULL);
-                assert_success(error, "send down and receive from below");
+
+            if (check_convergence) {
+                float max_change = 0;
+                for (int i = 0; i < 5; i++) {
+                    max_change = changes[i] > max_change ? changes[i] : max_change;
+                }
+                error = MPI_Allreduce(MPI_IN_PLACE, &max_change, 1, MPI_FLOAT, MPI_MAX, grid);
+                assert_success(error, "reduce max change");
+                if (max_change < tolerance) {
+                    break;
+                }
             }
         }
+        wait_halo_exchange(&halos);
+        finish_halo_reads(&halos);
 
-        // Gather results to master.
-        int result_len = rows_per_worker * padded_row_len;
-        error = MPI_Gather(local_matrix + padded_row_len, result_len, MPI_FLOAT, matrix + padded_row_len, result_len, MPI_FLOAT, MASTER_RANK, MPI_COMM_WORLD);
-        assert_success(error, "gather results");
+        // Calculate averages.
+        compute_statistics(grid, buffers[current], local_block, local_row_len, num_rows * row_len, &avg, &avg_diff);
 
-        free(local_matrix);
-        free(local_matrix_copy);
+        // The checkpoint file belongs to the grid, so it is closed before the grid.
+        finish_checkpoint(&checkpoint);
+        free_halo_exchange(&halos);
+        MPI_Comm_free(&grid);
     }
 
     if (mpi_rank == MASTER_RANK) {
-        // Calculate and print averages.
-        float avg = average(matrix, num_rows, row_len); 
-        float avg_diff = average_diff(matrix, avg, num_rows, row_len);
         printf("average: %lf\naverage absolute difference: %lf\n", avg, avg_diff);
+        if (tolerance >= 0) {
+            printf("iterations: %ld\n", iterations_done);
+        }
     }
 
     // Release resources.
-    error = MPI_Finalize();
-    assert_success(error, "finalize");
+    free(checkpoint.cells);
+    free_placement(&placement);
+    return 0;
+}
 
-    if (mpi_rank == MASTER_RANK) {
-        free(matrix);
+long get_matrix_index(long row, long col, long row_len) {
+    return (row+1) * (row_len+2) + col + 1;
+}
+
+// Heat spreads at most one cell per iteration, so after growing the region by one
+// cell in every direction everything outside of it is guaranteed to still be zero.
+void grow_region(struct region* r, long num_rows, long row_len) {
+    if (r->row_begin >= r->row_end || r->col_begin >= r->col_end) {
+        return;
     }
+    r->row_begin = r->row_begin > 0 ? r->row_begin - 1 : 0;
+    r->row_end = r->row_end < num_rows ? r->row_end + 1 : num_rows;
+    r->col_begin = r->col_begin > 0 ? r->col_begin - 1 : 0;
+    r->col_end = r->col_end < row_len ? r->col_end + 1 : row_len;
 }
 
-void read_dimensions(FILE* f, long* rows, long* cols) {
-    int read = fscanf(f, "%zu %zu\n", cols, rows);
-    if (read < 2) {
-        printf("error read input file\n");
-        exit(1);
+// The part of r within bounds, or an empty region if they do not overlap.
+struct region intersect_regions(struct region r, struct region bounds) {
+    struct region clipped;
+    clipped.row_begin = r.row_begin > bounds.row_begin ? r.row_begin : bounds.row_begin;
+    clipped.row_end = r.row_end < bounds.row_end ? r.row_end : bounds.row_end;
+    clipped.col_begin = r.col_begin > bounds.col_begin ? r.col_begin : bounds.col_begin;
+    clipped.col_end = r.col_end < bounds.col_end ? r.col_end : bounds.col_end;
+    if (region_is_empty(clipped)) {
+        clipped.row_begin = clipped.row_end = clipped.col_begin = clipped.col_end = 0;
     }
+    return clipped;
+}
+
+struct region shift_region(struct region r, long rows, long cols) {
+    r.row_begin += rows;
+    r.row_end += rows;
+    r.col_begin += cols;
+    r.col_end += cols;
+    return r;
+}
+
+// Grows a region by the given number of cells on every side, or shrinks it if negative.
+struct region expand_region(struct region r, long cells) {
+    r.row_begin -= cells;
+    r.row_end += cells;
+    r.col_begin -= cells;
+    r.col_end += cells;
+    return r;
+}
+
+int region_is_empty(struct region r) {
+    return r.row_begin >= r.row_end || r.col_begin >= r.col_end;
+}
+
+// The cells of the matrix that belong to the given rank. The rows and columns are
+// split as evenly as possible, so blocks differ by at most one row or column.
+struct region get_block(MPI_Comm grid, int grid_rank, long num_rows, long row_len) {
+    int dims[2], periods[2], coords[2];
+    int error = MPI_Cart_get(grid, 2, dims, periods, coords);
+    assert_success(error, "get process grid");
+    error = MPI_Cart_coords(grid, grid_rank, 2, coords);
+    assert_success(error, "get grid coordinates");
+
+    struct region block;
+    block.row_begin = num_rows * coords[0] / dims[0];
+    block.row_end = num_rows * (coords[0] + 1) / dims[0];
+    block.col_begin = row_len * coords[1] / dims[1];
+    block.col_end = row_len * (coords[1] + 1) / dims[1];
+    return block;
 }
 
-void read_matrix_values(FILE* f, float matrix[], long cols) {
-    long row, col, i;
-    float val;
-    int read;
-    while ((read = fscanf(f, "%zu %zu %f\n", &col, &row, &val)) == 3) {
-        i = get_matrix_index(row, col, cols);
-        matrix[i] = val;
+// The bounding box of the non-zero values of all blocks, from the one of the block
+// read by each rank. The ends are negated so that one minimum covers all four.
+struct region find_active_region(MPI_Comm grid, struct diffusion_input* input, struct region block) {
+    long bounds[4] = {LONG_MAX, LONG_MAX, LONG_MAX, LONG_MAX};
+    if (input->row_begin < input->row_end) {
+        bounds[0] = block.row_begin + input->row_begin;
+        bounds[1] = -(block.row_begin + input->row_end);
+        bounds[2] = block.col_begin + input->col_begin;
+        bounds[3] = -(block.col_begin + input->col_end);
+    }
+    int error = MPI_Allreduce(MPI_IN_PLACE, bounds, 4, MPI_LONG, MPI_MIN, grid);
+    assert_success(error, "reduce active region");
+
+    struct region active = {0, 0, 0, 0};
+    if (bounds[0] != LONG_MAX) {
+        active.row_begin = bounds[0];
+        active.row_end = -bounds[1];
+        active.col_begin = bounds[2];
+        active.col_end = -bounds[3];
     }
+    return active;
 }
 
-long get_matrix_index(long row, long col, long row_len) {
-    return (row+1) * (row_len+2) + col + 1;
+// Picks the number of rows and columns of blocks. MPI_Dims_create would split the
+// ranks as evenly as possible between the two, which gives a tall and narrow matrix
+// long and thin blocks, so instead the split with the fewest ghost cells to receive
+// per block is picked, preferring whole rows on ties since those are contiguous. If
+// no split of all ranks fits in the matrix, fewer ranks are used. Returns the
+// number of ranks used.
+int choose_process_grid(int nmb_mpi_proc, long num_rows, long row_len, int dims[2]) {
+    for (int nodes = nmb_mpi_proc; nodes > 1; nodes--) {
+        long best_cost = -1;
+        for (int p = nodes; p >= 1; p--) {
+            int q = nodes / p;
+            if (p * q != nodes || p > num_rows || q > row_len) {
+                continue;
+            }
+            long block_rows = (num_rows + p - 1) / p;
+            long block_cols = (row_len + q - 1) / q;
+            long cost = (p > 2 ? 2 : p - 1) * block_cols + (q > 2 ? 2 : q - 1) * block_rows;
+            if (best_cost == -1 || cost < best_cost) {
+                best_cost = cost;
+                dims[0] = p;
+                dims[1] = q;
+            }
+        }
+        if (best_cost != -1) {
+            return nodes;
+        }
+    }
+    dims[0] = dims[1] = 1;
+    return 1;
 }
 
-void apply_heat_diffusion(float* dst_matrix, float* src_matrix, long num_rows, long row_len, float diffusion_constant) {
-    long i = row_len + 3;
-    for (long r = 0; r < num_rows; r++) {
-        for (long c = 0; c < row_len; c++) {
-            dst_matrix[i] = calculate_new_temperature(src_matrix, i, row_len, diffusion_constant);
-            i++;
+// Exchanging ghost cells of depth k every k iterations costs one message latency per
+// k iterations, but about k - 1 redundantly updated layers around the block per
+// iteration on average. The bandwidth cost per iteration does not depend on k, so
+// the best depth is about sqrt(latency / time to update a layer). The master
+// measures both, using a ping-pong with rank 1 and a row of the length of its block
+// border, and all ranks use its choice.
+long choose_halo_depth(MPI_Comm grid, long border_len, long max_depth) {
+    int error;
+    long depth = 1;
+    int grid_rank, grid_size;
+    MPI_Comm_rank(grid, &grid_rank);
+    MPI_Comm_size(grid, &grid_size);
+    if (grid_size < 2) {
+        return 1;
+    }
+
+    error = MPI_Barrier(grid);
+    assert_success(error, "probe barrier");
+    if (grid_rank == MASTER_RANK || grid_rank == 1) {
+        float msg = 0;
+        int other = 1 - grid_rank;
+        double start = MPI_Wtime();
+        for (int i = 0; i < PROBE_ROUNDS; i++) {
+            if (grid_rank == MASTER_RANK) {
+                MPI_Send(&msg, 1, MPI_FLOAT, other, PROBE_TAG, grid);
+                MPI_Recv(&msg, 1, MPI_FLOAT, other, PROBE_TAG, grid, MPI_STATUS_IGNORE);
+            } else {
+                MPI_Recv(&msg, 1, MPI_FLOAT, other, PROBE_TAG, grid, MPI_STATUS_IGNORE);
+                MPI_Send(&msg, 1, MPI_FLOAT, other, PROBE_TAG, grid);
+            }
+        }
+        double latency = (MPI_Wtime() - start) / (2 * PROBE_ROUNDS);
+
+        if (grid_rank == MASTER_RANK) {
+            float* src = (float*) calloc(3 * (border_len + 2), sizeof(float));
+            float* dst = (float*) calloc(3 * (border_len + 2), sizeof(float));
+            struct region row = {0, 1, 0, border_len};
+            start = MPI_Wtime();
+            for (int i = 0; i < PROBE_ROUNDS; i++) {
+                apply_heat_diffusion(dst, src, row, border_len, 0.5, NULL);
+                swap(&src, &dst);
+            }
+            double row_time = (MPI_Wtime() - start) / PROBE_ROUNDS;
+            free(src);
+            free(dst);
+
+            depth = (long) (sqrt(latency / row_time) + 0.5);
         }
-        i += 2;
     }
+
+    error = MPI_Bcast(&depth, 1, MPI_LONG, MASTER_RANK, grid);
+    assert_success(error, "broadcast halo depth");
+    depth = depth < max_depth ? depth : max_depth;
+    return depth > 0 ? depth : 1;
 }
 
-float calculate_new_temperature(float* matrix, long i, long row_len, float diffusion_constant) {
-    float self = matrix[i];
-    float left = matrix[i-1];
-    float right = matrix[i+1];
-    float above = matrix[i-row_len-2];
-    float below = matrix[i+row_len+2];
-    return self + diffusion_constant * ((left + right + above + below) / 4 - self);
+// If max_change is not NULL, the largest absolute change of any cell is written to it.
+// This is kept out of the regular loop so that it only costs on convergence checks.
+void apply_heat_diffusion(float* dst_matrix, float* src_matrix, struct region active, long row_len, float diffusion_constant, float* max_change) {
+    struct diffusion_block region = {active.row_begin, active.row_end, active.col_begin, active.col_end};
+    long base = get_matrix_index(0, 0, row_len);
+    diffusion_stencil_apply(dst_matrix + base, src_matrix + base, row_len + 2, &region, diffusion_constant, max_change);
+}
+
+// The part of a block, in its local coordinates, that is sent to neighbor d, or the
+// ghost cells that are received from it.
+struct region get_halo_part(struct region block, long depth, int d, int ghost) {
+    long rows = block.row_end - block.row_begin;
+    long cols = block.col_end - block.col_begin;
+    long sizes[2] = {rows, cols};
+    long begins[2], ends[2];
+    for (int i = 0; i < 2; i++) {
+        int offset = neighbor_offsets[d][i];
+        if (offset < 0) {
+            begins[i] = ghost ? -depth : 0;
+        } else if (offset > 0) {
+            begins[i] = ghost ? sizes[i] : sizes[i] - depth;
+        } else {
+            begins[i] = 0;
+        }
+        ends[i] = begins[i] + (offset == 0 ? sizes[i] : depth);
+    }
+    struct region part = {begins[0], ends[0], begins[1], ends[1]};
+    return part;
+}
+
+// The number of cells of the matrices holding a block with depth ghost cells on
+// every side.
+long get_local_matrix_len(struct region block, long depth) {
+    return (block.row_end - block.row_begin + 2 * depth) * (block.col_end - block.col_begin + 2 * depth);
+}
+
+// The offset of the matrices as passed on, so that local cell (r, c) is at
+// get_matrix_index(r, c, local_row_len) for -depth <= r, c.
+long get_local_base(struct region block, long depth) {
+    return (depth - 1) * (block.col_end - block.col_begin + 2 * depth) + depth - 1;
+}
+
+// Allocates the two matrices, offset as by get_local_base, into buffers and copies
+// initial to the first. Their borders are sent to the neighbors on other nodes with
+// derived datatypes, so nothing is packed.
+void init_halo_exchange(struct halo_exchange* halos, float* buffers[2], float* initial, MPI_Comm grid, struct region block, long num_rows, long row_len, long depth, int huge_pages) {
+    int error;
+    int grid_rank, dims[2], periods[2], coords[2];
+    MPI_Comm_rank(grid, &grid_rank);
+    error = MPI_Cart_get(grid, 2, dims, periods, coords);
+    assert_success(error, "get process grid");
+    halos->pending_buffer = 0;
+    halos->local_row_len = block.col_end - block.col_begin + 2 * depth - 2;
+
+    // Every rank gets its own piece of the window, so that it is placed in memory
+    // close to the rank.
+    MPI_Comm node;
+    error = MPI_Comm_split_type(grid, MPI_COMM_TYPE_SHARED, grid_rank, MPI_INFO_NULL, &node);
+    assert_success(error, "split node communicator");
+    MPI_Info info;
+    MPI_Info_create(&info);
+    MPI_Info_set(info, "alloc_shared_noncontig", "true");
+    long len = get_local_matrix_len(block, depth);
+    float* segment;
+    error = MPI_Win_allocate_shared(2 * len * sizeof(float), sizeof(float), info, node, &segment, &halos->window);
+    assert_success(error, "allocate shared matrices");
+    MPI_Info_free(&info);
+
+    // The matrices are filled by the threads that go on to update them, so that their
+    // pages are spread over the NUMA nodes the threads of the rank run on.
+    if (huge_pages) {
+        advise_huge_pages(segment, 2 * len * sizeof(float));
+    }
+    long stride = block.col_end - block.col_begin + 2 * depth;
+    struct diffusion_block padded = {0, block.row_end - block.row_begin + 2 * depth, 0, stride};
+    diffusion_stencil_first_touch(segment, initial, stride, &padded);
+    diffusion_stencil_first_touch(segment + len, NULL, stride, &padded);
+    buffers[0] = segment + get_local_base(block, depth);
+    buffers[1] = segment + len + get_local_base(block, depth);
+    error = MPI_Win_lock_all(MPI_MODE_NOCHECK, halos->window);
+    assert_success(error, "lock shared matrices");
+
+    MPI_Group grid_group, node_group;
+    MPI_Comm_group(grid, &grid_group);
+    MPI_Comm_group(node, &node_group);
+
+    for (int d = 0; d < NUM_NEIGHBORS; d++) {
+        int neighbor_coords[2] = {coords[0] + neighbor_offsets[d][0], coords[1] + neighbor_offsets[d][1]};
+        int opposite = NUM_NEIGHBORS - 1 - d;
+        halos->pending[d] = 0;
+        halos->pending_done[d] = 0;
+        halos->shared[0][d] = halos->shared[1][d] = NULL;
+        if (neighbor_coords[0] < 0 || neighbor_coords[0] >= dims[0] || neighbor_coords[1] < 0 || neighbor_coords[1] >= dims[1]) {
+            halos->neighbors[d] = MPI_PROC_NULL;
+            continue;
+        }
+        error = MPI_Cart_rank(grid, neighbor_coords, &halos->neighbors[d]);
+        assert_success(error, "get neighbor rank");
+        int node_rank;
+        MPI_Group_translate_ranks(grid_group, 1, &halos->neighbors[d], node_group, &node_rank);
+
+        struct region parts[2] = {get_halo_part(block, depth, d, 1), get_halo_part(block, depth, d, 0)};
+        halos->ghost_parts[d] = parts[0];
+
+        if (node_rank != MPI_UNDEFINED) {
+            // The neighbor's matrices and the part of them that fills the ghost cells.
+            struct region neighbor_block = get_block(grid, halos->neighbors[d], num_rows, row_len);
+            MPI_Aint size;
+            int disp_unit;
+            float* neighbor_segment;
+            error = MPI_Win_shared_query(halos->window, node_rank, &size, &disp_unit, &neighbor_segment);
+            assert_success(error, "query neighbor matrices");
+            long neighbor_len = get_local_matrix_len(neighbor_block, depth);
+            halos->shared[0][d] = neighbor_segment + get_local_base(neighbor_block, depth);
+            halos->shared[1][d] = neighbor_segment + neighbor_len + get_local_base(neighbor_block, depth);
+            halos->shared_parts[d] = get_halo_part(neighbor_block, depth, opposite, 0);
+            halos->shared_row_lens[d] = neighbor_block.col_end - neighbor_block.col_begin + 2 * depth - 2;
+
+            for (int b = 0; b < 2; b++) {
+                error = MPI_Recv_init(NULL, 0, MPI_BYTE, halos->neighbors[d], HALO_TAG + opposite, grid, &halos->requests[b][d][0]);
+                assert_success(error, "init receive from neighbor");
+                error = MPI_Send_init(NULL, 0, MPI_BYTE, halos->neighbors[d], HALO_TAG + d, grid, &halos->requests[b][d][1]);
+                assert_success(error, "init send to neighbor");
+            }
+            error = MPI_Recv_init(NULL, 0, MPI_BYTE, halos->neighbors[d], DONE_TAG + opposite, grid, &halos->done[d][0]);
+            assert_success(error, "init receive from neighbor");
+            error = MPI_Send_init(NULL, 0, MPI_BYTE, halos->neighbors[d], DONE_TAG + d, grid, &halos->done[d][1]);
+            assert_success(error, "init send to neighbor");
+            continue;
+        }
+
+        for (int i = 0; i < 2; i++) {
+            halos->types[d][i] = create_block_type(parts[i], halos->local_row_len);
+        }
+        for (int b = 0; b < 2; b++) {
+            float* m = buffers[b];
+            error = MPI_Recv_init(m + get_matrix_index(parts[0].row_begin, parts[0].col_begin, halos->local_row_len), 1, halos->types[d][0],
+                halos->neighbors[d], HALO_TAG + opposite, grid, &halos->requests[b][d][0]);
+            assert_success(error, "init receive from neighbor");
+            error = MPI_Send_init(m + get_matrix_index(parts[1].row_begin, parts[1].col_begin, halos->local_row_len), 1, halos->types[d][1],
+                halos->neighbors[d], HALO_TAG + d, grid, &halos->requests[b][d][1]);
+            assert_success(error, "init send to neighbor");
+        }
+    }
+
+    MPI_Group_free(&grid_group);
+    MPI_Group_free(&node_group);
+    MPI_Comm_free(&node);
+    halos->buffers[0] = buffers[0];
+    halos->buffers[1] = buffers[1];
+}
+
+// Starts sending the border of the given buffer and receiving its ghost cells. The
+// exchange with a neighbor is skipped if the active region is not within depth cells
+// of the boundary they share, which both of them see the same way.
+void start_halo_exchange(struct halo_exchange* halos, int buffer, struct region active, struct region block, long depth) {
+    int error;
+    halos->pending_buffer = buffer;
+
+    // Make the border visible to the neighbors on the same node.
+    MPI_Win_sync(halos->window);
+
+    for (int d = 0; d < NUM_NEIGHBORS; d++) {
+        halos->pending[d] = 0;
+        if (halos->neighbors[d] == MPI_PROC_NULL) {
+            continue;
+        }
+        // The ghost cells, and the cells of the block that the neighbor receives.
+        struct region boundary = shift_region(get_halo_part(block, depth, d, 1), block.row_begin, block.col_begin);
+        boundary.row_begin -= neighbor_offsets[d][0] > 0 ? depth : 0;
+        boundary.row_end += neighbor_offsets[d][0] < 0 ? depth : 0;
+        boundary.col_begin -= neighbor_offsets[d][1] > 0 ? depth : 0;
+        boundary.col_end += neighbor_offsets[d][1] < 0 ? depth : 0;
+        if (region_is_empty(intersect_regions(active, boundary))) {
+            continue;
+        }
+
+        halos->pending[d] = 1;
+        error = MPI_Startall(2, halos->requests[buffer][d]);
+        assert_success(error, "start exchange with neighbor");
+    }
+}
+
+// Waits for the ghost cells, and copies those of the neighbors on the same node out
+// of their matrices.
+void wait_halo_exchange(struct halo_exchange* halos) {
+    int error;
+    int synced = 0;
+    int b = halos->pending_buffer;
+    finish_halo_reads(halos);
+    for (int d = 0; d < NUM_NEIGHBORS; d++) {
+        if (!halos->pending[d]) {
+            continue;
+        }
+        error = MPI_Waitall(2, halos->requests[b][d], MPI_STATUSES_IGNORE);
+        assert_success(error, "wait for exchange with neighbor");
+        halos->pending[d] = 0;
+        if (halos->shared[b][d] == NULL) {
+            continue;
+        }
+
+        if (!synced) {
+            MPI_Win_sync(halos->window);
+            synced = 1;
+        }
+        struct region dst = halos->ghost_parts[d];
+        struct region src = halos->shared_parts[d];
+        for (long r = 0; r < dst.row_end - dst.row_begin; r++) {
+            memcpy(halos->buffers[b] + get_matrix_index(dst.row_begin + r, dst.col_begin, halos->local_row_len),
+                halos->shared[b][d] + get_matrix_index(src.row_begin + r, src.col_begin, halos->shared_row_lens[d]),
+                sizeof(float) * (dst.col_end - dst.col_begin));
+        }
+        error = MPI_Startall(2, halos->done[d]);
+        assert_success(error, "start done message to neighbor");
+        halos->pending_done[d] = 1;
+    }
+}
+
+// Waits for the neighbors on the same node to have read the border that was last
+// exchanged.
+void finish_halo_reads(struct halo_exchange* halos) {
+    int error;
+    int any = 0;
+    for (int d = 0; d < NUM_NEIGHBORS; d++) {
+        if (halos->pending_done[d]) {
+            error = MPI_Waitall(2, halos->done[d], MPI_STATUSES_IGNORE);
+            assert_success(error, "wait for neighbor to read border");
+            halos->pending_done[d] = 0;
+            any = 1;
+        }
+    }
+    if (any) {
+        MPI_Win_sync(halos->window);
+    }
+}
+
+void free_halo_exchange(struct halo_exchange* halos) {
+    for (int d = 0; d < NUM_NEIGHBORS; d++) {
+        if (halos->neighbors[d] == MPI_PROC_NULL) {
+            continue;
+        }
+        for (int i = 0; i < 2; i++) {
+            MPI_Request_free(&halos->requests[0][d][i]);
+            MPI_Request_free(&halos->requests[1][d][i]);
+            if (halos->shared[0][d] != NULL) {
+                MPI_Request_free(&halos->done[d][i]);
+            } else {
+                MPI_Type_free(&halos->types[d][i]);
+            }
+        }
+    }
+    MPI_Win_unlock_all(halos->window);
+    MPI_Win_free(&halos->window);
+}
+
+// A datatype for the cells of r in a matrix with rows of row_len cells padded by a
+// column on each side, starting at the first cell of r.
+MPI_Datatype create_block_type(struct region r, long row_len) {
+    MPI_Datatype type;
+    MPI_Type_vector(r.row_end - r.row_begin, r.col_end - r.col_begin, row_len + 2, MPI_FLOAT, &type);
+    MPI_Type_commit(&type);
+    return type;
+}
+
+// Every rank copies its block, which is overwritten two iterations from now, and
+// writes it to its own part of the checkpoint file with non-blocking MPI-IO, through a
+// file view that skips the cells of the other blocks. The master also writes the header.
+void start_checkpoint(struct checkpoint* cp, MPI_Comm comm, float* local_matrix, struct region block, long local_row_len, long num_rows, long row_len, long iteration, float diffusion_constant) {
+    int error;
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    finish_checkpoint(cp);
+
+    long local_rows = block.row_end - block.row_begin;
+    long local_cols = block.col_end - block.col_begin;
+    if (cp->cells == NULL) {
+        cp->cells = (float*) malloc(sizeof(float) * local_rows * local_cols);
+    }
+    for (long r = 0; r < local_rows; r++) {
+        memcpy(cp->cells + r * local_cols, local_matrix + get_matrix_index(r, 0, local_row_len), sizeof(float) * local_cols);
+    }
+
+    // Like write_diffusion_checkpoint, the file is written under a temporary name and
+    // only renamed into place once complete.
+    char tmp_filename[DIFFUSION_CHECKPOINT_FILENAME_LEN + 4];
+    diffusion_checkpoint_filename(cp->filename, iteration);
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", cp->filename);
+    error = MPI_File_open(comm, tmp_filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &cp->file);
+    assert_success(error, "open checkpoint");
+    MPI_Offset header_len = sizeof(struct diffusion_checkpoint_header);
+    error = MPI_File_set_size(cp->file, header_len + num_rows * row_len * sizeof(float));
+    assert_success(error, "set checkpoint size");
+    cp->comm = comm;
+    cp->open = 1;
+
+    // The view cannot be changed while writes are pending, so the header is written
+    // first.
+    if (rank == MASTER_RANK) {
+        struct diffusion_checkpoint_header header;
+        init_diffusion_checkpoint_header(&header, num_rows, row_len, iteration, diffusion_constant);
+        error = MPI_File_write_at(cp->file, 0, &header, header_len, MPI_BYTE, MPI_STATUS_IGNORE);
+        assert_success(error, "write checkpoint header");
+    }
+
+    MPI_Datatype file_type;
+    MPI_Type_vector(local_rows, local_cols, row_len, MPI_FLOAT, &file_type);
+    MPI_Type_commit(&file_type);
+    error = MPI_File_set_view(cp->file, header_len + (block.row_begin * row_len + block.col_begin) * sizeof(float),
+        MPI_FLOAT, file_type, "native", MPI_INFO_NULL);
+    assert_success(error, "set checkpoint view");
+    MPI_Type_free(&file_type);
+
+    error = MPI_File_iwrite_at(cp->file, 0, cp->cells, local_rows * local_cols, MPI_FLOAT, &cp->request);
+    assert_success(error, "write checkpoint block");
+}
+
+// Waits for the checkpoint being written, if any. All ranks must call this the same
+// number of times since closing the file is collective.
+void finish_checkpoint(struct checkpoint* cp) {
+    if (!cp->open) {
+        return;
+    }
+
+    int error = MPI_Wait(&cp->request, MPI_STATUS_IGNORE);
+    assert_success(error, "wait for checkpoint");
+    error = MPI_File_close(&cp->file);
+    assert_success(error, "close checkpoint");
+    cp->open = 0;
+
+    int rank;
+    MPI_Comm_rank(cp->comm, &rank);
+    if (rank == MASTER_RANK) {
+        char tmp_filename[DIFFUSION_CHECKPOINT_FILENAME_LEN + 4];
+        snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", cp->filename);
+        if (rename(tmp_filename, cp->filename) != 0) {
+            printf("could not write checkpoint %s\n", cp->filename);
+            exit(1);
+        }
+    }
 }
 
 void assert_success(int error, char* msg) {
@@ -237,36 +1008,37 @@ void print_matrix(int rank, float* matrix, long matrix_len, long row_len) {
     }
 }
 
-float average(float* matrix, long rows, long cols) {
-    float avg = 0;
-    long d = 1;
-    long i = cols + 3;
-    for (long r = 0; r < rows; r++) {
-        for (long c = 0; c < cols; c++) {
-            float x = matrix[i];
-            avg += (x - avg) / d;
-            d++;
-            i++;
-        }
-        i += 2;
-    }
-    return avg;
-}
+// The mean and the mean absolute difference of all cells, from sums over the blocks
+// of all ranks. The mean absolute difference is summed around a pivot estimated from
+// a sample of every block in the same pass as the mean, so the blocks are only read
+// once unless the pivot is off.
+void compute_statistics(MPI_Comm grid, float* local_matrix, struct region local_block, long local_row_len, long num_cells, float* avg, float* avg_diff) {
+    int error;
+    struct diffusion_block region = {local_block.row_begin, local_block.row_end, local_block.col_begin, local_block.col_end};
+    const float* m = local_matrix + get_matrix_index(0, 0, local_row_len);
+    long stride = local_row_len + 2;
 
-float average_diff(float* matrix, float avg, long rows, long cols) {
-    float avg_diff = 0;
-    long d = 1;
-    long i = cols + 3;
-    for (long r = 0; r < rows; r++) {
-        for (long c = 0; c < cols; c++) {
-            float x = fabs(matrix[i] - avg);
-            avg_diff += (x - avg_diff) / d;
-            d++;
-            i++;
-        }
-        i += 2;
-    }
-    return avg_diff;
+    double moments[3] = {0};
+    diffusion_reduce_sample(m, stride, &region, moments);
+    error = MPI_Allreduce(MPI_IN_PLACE, moments, 3, MPI_DOUBLE, MPI_SUM, grid);
+    assert_success(error, "reduce samples");
+    double pivot, window;
+    diffusion_reduce_pivot(moments, &pivot, &window);
+
+    struct diffusion_reduction red;
+    diffusion_reduce_fused(&red, m, stride, &region, pivot, window);
+    double sum = red.sum;
+    error = MPI_Allreduce(MPI_IN_PLACE, &sum, 1, MPI_DOUBLE, MPI_SUM, grid);
+    assert_success(error, "reduce sum");
+    double mean = sum / num_cells;
+
+    double diff_sum = diffusion_reduce_finish(&red, m, stride, &region, mean);
+    diffusion_reduce_free(&red);
+    error = MPI_Allreduce(MPI_IN_PLACE, &diff_sum, 1, MPI_DOUBLE, MPI_SUM, grid);
+    assert_success(error, "reduce absolute differences");
+
+    *avg = mean;
+    *avg_diff = diff_sum / num_cells;
 }
 
 void swap(float** m1, float** m2) {